@@ -306,6 +306,9 @@
 #define BIT_VoltLowOff              BITS(7,11)  /* Low voltage off configuration register [7:11] */
 #define BIT_RepLow                  BITS(12,15) /* RepCap low threshold configuration bits [12:15] */
 
+#define REG_FStat                   0x3D        /* Fuel gauge status register */
+#define BIT_DNR                     BIT(0)      /* Data not ready indication bit */
+
 #define REG_Status2                 0xB0        /* Status 2 register */
 #define BIT_Hib                     BIT(1)      /* Fuel gauge hibernation mode status bit */
 #define BIT_FullDet                 BIT(5)      /* Fully charged configuration bit */
@@ -494,6 +497,7 @@
 #define REG_VFSOC0                  0x48
 #define REG_VFSOC                   0xFF
 #define REG_VFSOC0Enable            0x60
+#define REG_Command                 0x60
 #define REG_MLOCKReg1               0x62
 #define REG_MLOCKReg2               0x63
 
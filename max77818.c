@@ -14,16 +14,469 @@
 #include <linux/of_gpio.h>
 #include <linux/platform_device.h>
 #include <linux/gpio/consumer.h>
+#include <linux/idr.h>
+#include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <net/genetlink.h>
 
 #include <linux/mfd/max77818-private.h>
 #include <linux/mfd/max77818.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/max77818_trace.h>
+
 struct mfd_cell max77818_devices[] = {
 	{ .name = "max77818-reg", .of_compatible="maxim,max77818-reg" },
 	{ .name = "max77818-fg",  .of_compatible="maxim,max77818-fg"},
 	{ .name = "max77818-chg", .of_compatible="maxim,max77818-chg" },
 };
 
+/* Instance numbers, the first PMIC keeps the legacy unsuffixed names */
+static DEFINE_IDA(max77818_ida);
+
+/*
+ * The new listener is handed the effective mode right away, so votes cast
+ * before the charger binds are not lost. This covers the mode only; the
+ * battery limits go through register_limits_notifier().
+ */
+int register_mode_notifier(struct max77818_dev *max77818, struct notifier_block *n)
+{
+	int ret_val;
+
+	mutex_lock(&max77818->mode_lock);
+	ret_val = blocking_notifier_chain_register(&max77818->mode_notifier, n);
+	if (!ret_val)
+		n->notifier_call(n, max77818->mode, NULL);
+	mutex_unlock(&max77818->mode_lock);
+
+	return ret_val;
+}
+EXPORT_SYMBOL_GPL(register_mode_notifier);
+
+int unregister_mode_notifier(struct max77818_dev *max77818, struct notifier_block *n)
+{
+	return blocking_notifier_chain_unregister(&max77818->mode_notifier, n);
+}
+EXPORT_SYMBOL_GPL(unregister_mode_notifier);
+
+/*
+ * Limits are published by the fuelgauge once it has loaded a battery
+ * profile. A listener registering later is handed them right away, so the
+ * charger applies them whichever of the two binds first.
+ */
+int register_limits_notifier(struct max77818_dev *max77818, struct notifier_block *n)
+{
+	int ret_val;
+
+	mutex_lock(&max77818->limits_lock);
+	ret_val = blocking_notifier_chain_register(&max77818->limits_notifier, n);
+	if (!ret_val && max77818->battery_limits.valid)
+		n->notifier_call(n, 0, &max77818->battery_limits);
+	mutex_unlock(&max77818->limits_lock);
+
+	return ret_val;
+}
+EXPORT_SYMBOL_GPL(register_limits_notifier);
+
+int unregister_limits_notifier(struct max77818_dev *max77818, struct notifier_block *n)
+{
+	return blocking_notifier_chain_unregister(&max77818->limits_notifier, n);
+}
+EXPORT_SYMBOL_GPL(unregister_limits_notifier);
+
+void max77818_set_battery_limits(struct max77818_dev *max77818,
+				 const struct max77818_battery_limits *limits)
+{
+	mutex_lock(&max77818->limits_lock);
+	max77818->battery_limits = *limits;
+	max77818->battery_limits.valid = true;
+	blocking_notifier_call_chain(&max77818->limits_notifier, 0,
+				     &max77818->battery_limits);
+	mutex_unlock(&max77818->limits_lock);
+}
+EXPORT_SYMBOL_GPL(max77818_set_battery_limits);
+
+/**
+ * max77818_mode_vote - request a charger mode on behalf of a voter
+ * @max77818: parent device
+ * @voter: requesting client
+ * @mode: requested enum max77818_chg_mode, or MAX77818_NO_VOTE to withdraw
+ *
+ * The effective mode is the vote of the highest priority active voter, or
+ * MAX77818_MODE_DEFAULT without votes. Mode notifiers are only called
+ * when the effective mode changes.
+ */
+int max77818_mode_vote(struct max77818_dev *max77818,
+		       enum max77818_mode_voter voter, int mode)
+{
+	int i, new_mode = MAX77818_MODE_DEFAULT;
+
+	if (voter >= MAX77818_VOTER_MAX)
+		return -EINVAL;
+
+	mutex_lock(&max77818->mode_lock);
+
+	max77818->mode_votes[voter] = mode;
+	for (i = MAX77818_VOTER_MAX - 1; i >= 0; i--) {
+		if (max77818->mode_votes[i] != MAX77818_NO_VOTE) {
+			new_mode = max77818->mode_votes[i];
+			break;
+		}
+	}
+
+	if (new_mode != max77818->mode) {
+		trace_max77818_mode(max77818->id, voter, mode, max77818->mode, new_mode);
+		max77818->mode = new_mode;
+		blocking_notifier_call_chain(&max77818->mode_notifier, new_mode, NULL);
+	}
+
+	mutex_unlock(&max77818->mode_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(max77818_mode_vote);
+
+static const struct genl_multicast_group max77818_genl_mcgrps[] = {
+	{ .name = MAX77818_GENL_MCGRP },
+};
+
+/*
+ * The PMIC is a property of the machine, not of a network namespace, so
+ * the family lives in init_net only: it is neither visible nor joinable
+ * from other namespaces, and events are multicast there alone.
+ */
+static struct genl_family max77818_genl_family = {
+	.name = MAX77818_GENL_NAME,
+	.version = MAX77818_GENL_VERSION,
+	.maxattr = MAX77818_ATTR_MAX,
+	.netnsok = false,
+	.module = THIS_MODULE,
+	.mcgrps = max77818_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(max77818_genl_mcgrps),
+};
+
+/* Lets the ISRs skip gathering event fields nobody listens to */
+bool max77818_event_listeners(void)
+{
+	return genl_has_listeners(&max77818_genl_family, &init_net, 0);
+}
+EXPORT_SYMBOL_GPL(max77818_event_listeners);
+
+/**
+ * max77818_event_notify - multicast a decoded interrupt
+ * @max77818: parent device
+ * @event: event with the source specific fields filled in
+ *
+ * The instance number and timestamp are filled in here. Must be called
+ * from a context that may sleep.
+ */
+int max77818_event_notify(struct max77818_dev *max77818, struct max77818_event *event)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!max77818_event_listeners())
+		return 0;
+
+	event->id = max77818->id;
+	event->timestamp_ns = ktime_to_ns(ktime_get_boottime());
+
+	skb = genlmsg_new(nla_total_size(sizeof(*event)), GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(skb, 0, 0, &max77818_genl_family, 0, MAX77818_CMD_EVENT);
+	if (!hdr)
+		goto err;
+
+	if (nla_put(skb, MAX77818_ATTR_EVENT, sizeof(*event), event))
+		goto err;
+
+	genlmsg_end(skb, hdr);
+
+	return genlmsg_multicast(&max77818_genl_family, skb, 0, 0, GFP_KERNEL);
+
+err:
+	nlmsg_free(skb);
+	return -EMSGSIZE;
+}
+EXPORT_SYMBOL_GPL(max77818_event_notify);
+
+/* NACKs, lost arbitration and timeouts are worth another attempt */
+static bool max77818_i2c_transient(int err)
+{
+	switch (err) {
+	case -ENXIO:
+	case -EREMOTEIO:
+	case -EAGAIN:
+	case -ETIMEDOUT:
+	case -EIO:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void max77818_i2c_recover(struct max77818_dev *max77818,
+				 struct i2c_adapter *adap)
+{
+	int ret_val;
+
+	i2c_lock_bus(adap, I2C_LOCK_ROOT_ADAPTER);
+	ret_val = i2c_recover_bus(adap);
+	i2c_unlock_bus(adap, I2C_LOCK_ROOT_ADAPTER);
+
+	if (!ret_val)
+		atomic_inc(&max77818->i2c_stats.recoveries);
+	else if (ret_val != -EOPNOTSUPP)
+		dev_warn_ratelimited(max77818->dev, "i2c bus recovery failed: %d\n", ret_val);
+}
+
+#if defined(CONFIG_FAULT_INJECTION_DEBUG_FS)
+
+static DECLARE_FAULT_ATTR(max77818_fail_xfer);
+
+static bool max77818_fault_match(struct max77818_fault *fault,
+				 struct i2c_client *client, struct i2c_msg *msgs)
+{
+	u32 addr = READ_ONCE(fault->addr), reg = READ_ONCE(fault->reg);
+
+	if (addr && addr != client->addr)
+		return false;
+
+	return reg == MAX77818_FAULT_ANY || (msgs[0].len && msgs[0].buf[0] == reg);
+}
+
+/* i2c_transfer() with the faults armed in debugfs applied around it */
+static int max77818_i2c_transfer(struct max77818_dev *max77818,
+				 struct i2c_client *client, struct i2c_msg *msgs, int num)
+{
+	struct max77818_fault *fault = &max77818->fault;
+	struct i2c_msg *rd = &msgs[num - 1];
+	unsigned int delay_us, corrupt;
+	bool match;
+	int ret_val = 0, i;
+
+	match = max77818_fault_match(fault, client, msgs);
+	if (match && should_fail(&fault->attr, 1))
+		ret_val = -(int)READ_ONCE(fault->error);
+	delay_us = match ? READ_ONCE(fault->delay_us) : 0;
+	corrupt = match ? READ_ONCE(fault->corrupt) : 0;
+
+	if (delay_us)
+		usleep_range(delay_us, delay_us + delay_us / 8 + 1);
+
+	if (ret_val) {
+		atomic_inc(&fault->injected);
+		return ret_val;
+	}
+
+	ret_val = i2c_transfer(client->adapter, msgs, num);
+
+	/* Mask applies to each 16 bit word of read data, low byte first */
+	if (ret_val == num && corrupt && (rd->flags & I2C_M_RD)) {
+		for (i = 0; i < rd->len; i++)
+			rd->buf[i] ^= corrupt >> (8 * (i & 1));
+		atomic_inc(&fault->injected);
+	}
+
+	return ret_val;
+}
+
+static void max77818_fault_latency(struct max77818_dev *max77818, ktime_t start)
+{
+	u64 delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (delta > READ_ONCE(max77818->fault.max_xfer_ns))
+		WRITE_ONCE(max77818->fault.max_xfer_ns, delta);
+}
+
+static void max77818_fault_init(struct max77818_dev *max77818)
+{
+	struct max77818_fault *fault = &max77818->fault;
+
+	fault->attr = max77818_fail_xfer;
+	fault->reg = MAX77818_FAULT_ANY;
+	fault->error = EREMOTEIO;
+}
+
+static void max77818_fault_debugfs_init(struct max77818_fault *fault, struct dentry *dir)
+{
+	debugfs_create_x32("addr", 0600, dir, &fault->addr);
+	debugfs_create_x32("reg", 0600, dir, &fault->reg);
+	fault_create_debugfs_attr("fail_xfer", dir, &fault->attr);
+	debugfs_create_u32("error", 0600, dir, &fault->error);
+	debugfs_create_u32("delay_us", 0600, dir, &fault->delay_us);
+	debugfs_create_x32("corrupt", 0600, dir, &fault->corrupt);
+	debugfs_create_atomic_t("injected", 0400, dir, &fault->injected);
+	debugfs_create_u64("max_xfer_ns", 0600, dir, &fault->max_xfer_ns);
+}
+
+#else
+
+static inline int max77818_i2c_transfer(struct max77818_dev *max77818,
+					struct i2c_client *client, struct i2c_msg *msgs, int num)
+{
+	return i2c_transfer(client->adapter, msgs, num);
+}
+
+static inline void max77818_fault_latency(struct max77818_dev *max77818, ktime_t start) { }
+static inline void max77818_fault_init(struct max77818_dev *max77818) { }
+
+#endif
+
+/*
+ * All three slaves share one bus, so the retry state and the counters are
+ * kept per PMIC. Transient errors are retried with a bounded exponential
+ * backoff, a run of them triggers a bus recovery in between.
+ */
+static int max77818_i2c_xfer(struct i2c_client *client, struct i2c_msg *msgs, int num)
+{
+	struct max77818_dev *max77818 = i2c_get_clientdata(client);
+	struct max77818_i2c_stats *stats = &max77818->i2c_stats;
+	unsigned int backoff = MAX77818_I2C_BACKOFF_MIN_US;
+	ktime_t start = ktime_get();
+	int ret_val, attempt;
+
+	for (attempt = 0; ; attempt++) {
+		ret_val = max77818_i2c_transfer(max77818, client, msgs, num);
+		if (ret_val == num) {
+			atomic_set(&stats->consecutive, 0);
+			max77818_fault_latency(max77818, start);
+			return 0;
+		}
+		if (ret_val >= 0)
+			ret_val = -EIO;
+
+		atomic_inc(&stats->errors);
+		if (!max77818_i2c_transient(ret_val) || attempt == MAX77818_I2C_RETRIES)
+			break;
+
+		if (atomic_inc_return(&stats->consecutive) >= MAX77818_I2C_RECOVER_ERRORS) {
+			atomic_set(&stats->consecutive, 0);
+			max77818_i2c_recover(max77818, client->adapter);
+		}
+
+		atomic_inc(&stats->retries);
+		usleep_range(backoff, backoff * 2);
+		backoff = min_t(unsigned int, backoff * 2, MAX77818_I2C_BACKOFF_MAX_US);
+	}
+
+	atomic_inc(&stats->failures);
+	max77818_fault_latency(max77818, start);
+	dev_err_ratelimited(max77818->dev, "i2c 0x%02x transfer failed after %d attempts: %d\n",
+			    client->addr, attempt + 1, ret_val);
+
+	return ret_val;
+}
+
+static int max77818_i2c_write(void *context, const void *data, size_t count)
+{
+	struct i2c_client *client = context;
+	struct i2c_msg msg = {
+		.addr = client->addr,
+		.len = count,
+		.buf = (u8 *)data,
+	};
+
+	return max77818_i2c_xfer(client, &msg, 1);
+}
+
+static int max77818_i2c_read(void *context, const void *reg, size_t reg_size,
+			     void *val, size_t val_size)
+{
+	struct i2c_client *client = context;
+	struct i2c_msg msgs[] = {
+		{
+			.addr = client->addr,
+			.len = reg_size,
+			.buf = (u8 *)reg,
+		}, {
+			.addr = client->addr,
+			.flags = I2C_M_RD,
+			.len = val_size,
+			.buf = val,
+		},
+	};
+
+	return max77818_i2c_xfer(client, msgs, ARRAY_SIZE(msgs));
+}
+
+static const struct regmap_bus max77818_i2c_bus = {
+	.write = max77818_i2c_write,
+	.read = max77818_i2c_read,
+};
+
+static struct regmap *max77818_regmap_init(struct i2c_client *client,
+					   const struct regmap_config *config)
+{
+	return devm_regmap_init(&client->dev, &max77818_i2c_bus, client, config);
+}
+
+#define MAX77818_I2C_STAT_ATTR(_name)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct max77818_dev *max77818 = dev_get_drvdata(dev);		\
+									\
+	return scnprintf(buf, PAGE_SIZE, "%d\n",			\
+			 atomic_read(&max77818->i2c_stats._name));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+MAX77818_I2C_STAT_ATTR(errors);
+MAX77818_I2C_STAT_ATTR(retries);
+MAX77818_I2C_STAT_ATTR(failures);
+MAX77818_I2C_STAT_ATTR(recoveries);
+
+static struct attribute *max77818_i2c_stats_attrs[] = {
+	&dev_attr_errors.attr,
+	&dev_attr_retries.attr,
+	&dev_attr_failures.attr,
+	&dev_attr_recoveries.attr,
+	NULL,
+};
+
+static const struct attribute_group max77818_i2c_stats_group = {
+	.name = "i2c_stats",
+	.attrs = max77818_i2c_stats_attrs,
+};
+
+/**
+ * max77818_irq_storm - account one interrupt of a source
+ * @rate: per-source rate state, zeroed at start
+ *
+ * Returns true once the source fired MAX77818_IRQ_STORM_THRESHOLD times
+ * within MAX77818_IRQ_STORM_WINDOW_MS. The caller is expected to mask the
+ * source, poll it at MAX77818_IRQ_POLL_MS and re-arm it once it has been
+ * quiet for MAX77818_IRQ_QUIET_MS.
+ */
+bool max77818_irq_storm(struct max77818_irq_rate *rate)
+{
+	unsigned long now = jiffies;
+
+	if (!rate->count ||
+	    time_after(now, rate->window + msecs_to_jiffies(MAX77818_IRQ_STORM_WINDOW_MS))) {
+		rate->window = now;
+		rate->count = 0;
+	}
+
+	if (++rate->count < MAX77818_IRQ_STORM_THRESHOLD)
+		return false;
+
+	rate->count = 0;
+	rate->storms++;
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(max77818_irq_storm);
+
 static const struct regmap_config max77818_regmap_config = {
 	.reg_bits = 8,
 	.val_bits = 8,
@@ -85,12 +538,106 @@ static const struct regmap_irq_chip max77818_chg_irq_chip = {
 	.num_irqs = ARRAY_SIZE(max77818_chg_irqs),
 };
 
+#if defined(CONFIG_DEBUG_FS)
+
+/*
+ * "<chip> <index>" runs the handlers of a nested source as if the PMIC had
+ * raised it, so stress runs can drive the ISRs and the storm guard without
+ * real hardware events. Masked sources are left pending like real ones.
+ *
+ * The handlers expect to run one at a time from the parent IRQ thread, so
+ * the parent line is kept disabled meanwhile and writers take fire_lock.
+ */
+static ssize_t max77818_fire_irq_write(struct file *file, const char __user *ubuf,
+					size_t count, loff_t *ppos)
+{
+	struct max77818_dev *max77818 = file->private_data;
+	const struct regmap_irq_chip *chip;
+	struct regmap_irq_chip_data *data;
+	char buf[16], name[4];
+	unsigned int hwirq;
+	int virq;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = 0;
+
+	if (sscanf(buf, "%3s %u", name, &hwirq) != 2)
+		return -EINVAL;
+
+	if (!strcmp(name, "src")) {
+		chip = &max77818_src_irq_chip;
+		data = max77818->irq_chip_src;
+	} else if (!strcmp(name, "sys")) {
+		chip = &max77818_sys_irq_chip;
+		data = max77818->irq_chip_sys;
+	} else if (!strcmp(name, "chg")) {
+		chip = &max77818_chg_irq_chip;
+		data = max77818->irq_chip_chg;
+	} else {
+		return -EINVAL;
+	}
+
+	if (hwirq >= chip->num_irqs)
+		return -EINVAL;
+
+	virq = regmap_irq_get_virq(data, hwirq);
+	if (virq <= 0)
+		return -ENXIO;
+
+	mutex_lock(&max77818->fire_lock);
+	disable_irq(max77818->irq);
+	handle_nested_irq(virq);
+	enable_irq(max77818->irq);
+	mutex_unlock(&max77818->fire_lock);
+
+	return count;
+}
+
+static const struct file_operations max77818_fire_irq_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = max77818_fire_irq_write,
+	.llseek = no_llseek,
+};
+
+/* fire_irq only needs debugfs, the bus faults also need fault injection */
+static void max77818_debugfs_init(struct max77818_dev *max77818)
+{
+	char name[16];
+
+	mutex_init(&max77818->fire_lock);
+
+	snprintf(name, sizeof(name), "max77818-%d", max77818->id);
+	max77818->debugfs = debugfs_create_dir(name, NULL);
+
+	debugfs_create_file("fire_irq", 0200, max77818->debugfs, max77818,
+			    &max77818_fire_irq_fops);
+#if defined(CONFIG_FAULT_INJECTION_DEBUG_FS)
+	max77818_fault_debugfs_init(&max77818->fault, max77818->debugfs);
+#endif
+}
+
+static void max77818_debugfs_exit(struct max77818_dev *max77818)
+{
+	debugfs_remove_recursive(max77818->debugfs);
+}
+
+#else
+
+static inline void max77818_debugfs_init(struct max77818_dev *max77818) { }
+static inline void max77818_debugfs_exit(struct max77818_dev *max77818) { }
+
+#endif
+
 static int max77818_i2c_probe (struct i2c_client *client,
 				const struct i2c_device_id *id)
 {
 	struct max77818_dev *max77818;
 	struct device_node *np;
-	int ret_val;
+	int ret_val, i;
 	unsigned int chip_id = 0, chip_rev = 0;
 
 	max77818 = devm_kzalloc(&client->dev, sizeof(*max77818), GFP_KERNEL);
@@ -108,6 +655,16 @@ static int max77818_i2c_probe (struct i2c_client *client,
 		return -ENODEV;
 	}
 
+	max77818_fault_init(max77818);
+
+	BLOCKING_INIT_NOTIFIER_HEAD(&max77818->mode_notifier);
+	mutex_init(&max77818->mode_lock);
+	BLOCKING_INIT_NOTIFIER_HEAD(&max77818->limits_notifier);
+	mutex_init(&max77818->limits_lock);
+	for (i = 0; i < MAX77818_VOTER_MAX; i++)
+		max77818->mode_votes[i] = MAX77818_NO_VOTE;
+	max77818->mode = MAX77818_MODE_DEFAULT;
+
 	dev_info(max77818->dev, "%s: allocated interrupt: %d\n", __func__, max77818->irq);
 
 	max77818->i2c_sys = client;
@@ -126,20 +683,20 @@ static int max77818_i2c_probe (struct i2c_client *client,
 	}
 	i2c_set_clientdata(max77818->i2c_fg, max77818);
 
-	max77818->regmap_sys = devm_regmap_init_i2c(client, &max77818_regmap_config);
+	max77818->regmap_sys = max77818_regmap_init(client, &max77818_regmap_config);
 	if (IS_ERR(max77818->regmap_sys)) {
 		dev_err(max77818->dev, "%s: failed to initialize pmic regmap!",__func__);
 		goto err_regmap;
 	}
 
-	max77818->regmap_fg = devm_regmap_init_i2c(max77818->i2c_fg,
+	max77818->regmap_fg = max77818_regmap_init(max77818->i2c_fg,
 					&max77818_fg_regmap_config);
 	if (IS_ERR(max77818->regmap_fg)) {
 		dev_err(max77818->dev, "%s: failed to initialize fuelgauge regmap!",__func__);
 		goto err_regmap;
 	}
 
-	max77818->regmap_chg = devm_regmap_init_i2c(max77818->i2c_chg,
+	max77818->regmap_chg = max77818_regmap_init(max77818->i2c_chg,
 							&max77818_regmap_config);
 	if (IS_ERR(max77818->regmap_chg)) {
 		dev_err(max77818->dev, "%s: failed to initialize charger regmap!",__func__);
@@ -212,15 +769,27 @@ static int max77818_i2c_probe (struct i2c_client *client,
 		goto err_irq_sys;
 	}
 
-	ret_val = mfd_add_devices(max77818->dev, -1, max77818_devices,
-				ARRAY_SIZE(max77818_devices), NULL, 0, NULL);
+	ret_val = devm_device_add_group(max77818->dev, &max77818_i2c_stats_group);
 	if (ret_val)
+		dev_warn(max77818->dev, "%s: i2c stats sysfs failed: %d", __func__, ret_val);
+
+	max77818->id = ida_simple_get(&max77818_ida, 0, 0, GFP_KERNEL);
+	if (max77818->id < 0)
 		goto err_irq_chg;
 
+	ret_val = mfd_add_devices(max77818->dev, PLATFORM_DEVID_AUTO, max77818_devices,
+				ARRAY_SIZE(max77818_devices), NULL, 0, NULL);
+	if (ret_val)
+		goto err_ida;
+
+	max77818_debugfs_init(max77818);
+
 	dev_info(max77818->dev, "%s: max77818 init success. id: %Xh, rev: %X\n",__func__, chip_id, chip_rev);
 
 	return 0;
 
+err_ida:
+	ida_simple_remove(&max77818_ida, max77818->id);
 err_irq_chg:
 	regmap_del_irq_chip(max77818->irq, max77818->irq_chip_chg);
 err_irq_sys:
@@ -240,6 +809,7 @@ static int max77818_i2c_remove(struct i2c_client *i2c){
 	struct max77818_dev *max77818 = i2c_get_clientdata(i2c);
 
 	mfd_remove_devices(max77818->dev);
+	max77818_debugfs_exit(max77818);
 
 	regmap_del_irq_chip(max77818->irq, max77818->irq_chip_src);
 	regmap_del_irq_chip(max77818->irq, max77818->irq_chip_sys);
@@ -248,6 +818,8 @@ static int max77818_i2c_remove(struct i2c_client *i2c){
 	i2c_unregister_device(max77818->i2c_fg);
 	i2c_unregister_device(max77818->i2c_chg);
 
+	ida_simple_remove(&max77818_ida, max77818->id);
+
 	return 0;
 }
 
@@ -274,7 +846,28 @@ static struct i2c_driver max77818_i2c_driver = {
 	.id_table = max77818_i2c_id,
 };
 
-module_i2c_driver(max77818_i2c_driver);
+static int __init max77818_init(void)
+{
+	int ret_val;
+
+	ret_val = genl_register_family(&max77818_genl_family);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = i2c_add_driver(&max77818_i2c_driver);
+	if (ret_val)
+		genl_unregister_family(&max77818_genl_family);
+
+	return ret_val;
+}
+module_init(max77818_init);
+
+static void __exit max77818_exit(void)
+{
+	i2c_del_driver(&max77818_i2c_driver);
+	genl_unregister_family(&max77818_genl_family);
+}
+module_exit(max77818_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Nebojsa Stojiljkovic <nebojsa@keemail.me>");
@@ -3,11 +3,98 @@
 #ifndef  __LINUX_MAX77818_
 #define  __LINUX_MAX77818_
 
+#include <linux/max77818.h>
+
 #define GPIO_UNUSED -1
 
+/* Battery specific charger limits handed over from a fuelgauge profile */
+struct max77818_battery_limits {
+	bool valid;
+	int fast_charge_timer_timeout;
+	int charge_current_limit;
+	int topoff_current_threshold;
+	int topoff_timer_timeout;
+	int prim_charge_term_voltage;
+	int battery_overcurrent_threshold;
+};
+
+/* CHG_CNFG_00 MODE values requested through the mode arbiter */
+enum max77818_chg_mode {
+	MAX77818_MODE_BUCK = 0x04,              /* Charger off, buck on */
+	MAX77818_MODE_CHARGER_BUCK = 0x05,      /* Charger and buck on */
+	MAX77818_MODE_OTG = 0x0A,               /* Boost on, OTG output */
+	MAX77818_MODE_SELF_TEST = 0x0C,         /* Battery load for self-test */
+};
+
+#define MAX77818_MODE_DEFAULT  MAX77818_MODE_CHARGER_BUCK
+#define MAX77818_NO_VOTE       (-1)
+
+/* Mode voters in ascending priority, the highest active vote wins */
+enum max77818_mode_voter {
+	MAX77818_VOTER_USER,
+	MAX77818_VOTER_OTG,
+	MAX77818_VOTER_THERMAL,
+	MAX77818_VOTER_SELF_TEST,
+	MAX77818_VOTER_MAX,
+};
+
+/* Retry policy of the shared I2C bus, backoff doubles between attempts */
+#define MAX77818_I2C_RETRIES           4
+#define MAX77818_I2C_BACKOFF_MIN_US    100
+#define MAX77818_I2C_BACKOFF_MAX_US    5000
+#define MAX77818_I2C_RECOVER_ERRORS    3        /* Consecutive errors before bus recovery */
+
+/* IRQ storm guard, a source firing faster than this is masked and polled */
+#define MAX77818_IRQ_STORM_WINDOW_MS   1000
+#define MAX77818_IRQ_STORM_THRESHOLD   50       /* Events per window before masking */
+#define MAX77818_IRQ_POLL_MS           500      /* Poll period while masked */
+#define MAX77818_IRQ_QUIET_MS          5000     /* Stable time before re-arming */
+
+struct max77818_irq_rate {
+	unsigned long window;                   /* jiffies at the start of the window */
+	unsigned int count;
+	unsigned int storms;                    /* Times the source got masked */
+};
+
+struct max77818_i2c_stats {
+	atomic_t errors;                        /* Failed transfer attempts */
+	atomic_t retries;
+	atomic_t failures;                      /* Transfers given up on */
+	atomic_t recoveries;                    /* Successful bus recoveries */
+	atomic_t consecutive;                   /* Errors since the last success */
+};
+
+#if defined(CONFIG_FAULT_INJECTION_DEBUG_FS)
+
+#include <linux/fault-inject.h>
+
+#define MAX77818_FAULT_ANY             0xffffffff
+
+/*
+ * Bus faults armed from debugfs (max77818-<id>/). An access matches when
+ * addr (0 for any slave) and reg agree with it. Whether a matching access
+ * fails is decided by the fault_attr in fail_xfer/, so probability,
+ * interval, times and /proc/<pid>/fail-nth work as for other fault types.
+ */
+struct max77818_fault {
+	struct fault_attr attr;
+	u32 addr;                               /* 7 bit slave address, 0 for any */
+	u32 reg;                                /* Register, MAX77818_FAULT_ANY for any */
+	u32 error;                              /* Positive errno of injected failures */
+	u32 delay_us;                           /* Latency added to matching accesses */
+	u32 corrupt;                            /* XOR mask for matching read data */
+	atomic_t injected;
+	u64 max_xfer_ns;                        /* Worst transfer including retries */
+};
+
+#endif
+
 struct max77818_dev {
 	struct device *dev;
 
+	/* Instance number, 0 for the first PMIC */
+	int id;
+
 	struct gpio_desc *gpio;
 
 	int irq;
@@ -24,8 +111,26 @@ struct max77818_dev {
 	struct regmap *regmap_chg;
 	struct regmap *regmap_fg;
 
+	struct max77818_i2c_stats i2c_stats;
+#if defined(CONFIG_FAULT_INJECTION_DEBUG_FS)
+	struct max77818_fault fault;
+#endif
+#if defined(CONFIG_DEBUG_FS)
+	struct dentry *debugfs;                 /* max77818-<id>/ */
+	struct mutex fire_lock;                 /* fire_irq writers */
+#endif
+
 	int battery_enable_gpio;
 	int self_test_gpio;
+
+	struct max77818_battery_limits battery_limits;
+	struct blocking_notifier_head limits_notifier;
+	struct mutex limits_lock;
+
+	struct blocking_notifier_head mode_notifier;
+	struct mutex mode_lock;
+	int mode_votes[MAX77818_VOTER_MAX];
+	int mode;
 };
 
 enum max77818_irq {
@@ -46,7 +151,22 @@ enum max77818_irq {
 	MAX77818_CHG_IRQ_AICL_I,
 };
 
-int register_mode_notifier(struct notifier_block *n);
-int unregister_mode_notifier(struct notifier_block *n);
+int register_mode_notifier(struct max77818_dev *max77818, struct notifier_block *n);
+int unregister_mode_notifier(struct max77818_dev *max77818, struct notifier_block *n);
+int register_limits_notifier(struct max77818_dev *max77818, struct notifier_block *n);
+int unregister_limits_notifier(struct max77818_dev *max77818, struct notifier_block *n);
+void max77818_set_battery_limits(struct max77818_dev *max77818,
+				 const struct max77818_battery_limits *limits);
+int max77818_mode_vote(struct max77818_dev *max77818,
+		       enum max77818_mode_voter voter, int mode);
+bool max77818_irq_storm(struct max77818_irq_rate *rate);
+bool max77818_event_listeners(void);
+int max77818_event_notify(struct max77818_dev *max77818, struct max77818_event *event);
+
+static inline int max77818_mode_unvote(struct max77818_dev *max77818,
+				       enum max77818_mode_voter voter)
+{
+	return max77818_mode_vote(max77818, voter, MAX77818_NO_VOTE);
+}
 
 #endif
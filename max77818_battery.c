@@ -14,43 +14,64 @@
 #include <linux/interrupt.h>
 #include <linux/notifier.h>
 #include <linux/reboot.h>
+#include <linux/crc16.h>
+#include <linux/crc32.h>
+#include <linux/nvmem-consumer.h>
+#include <linux/slab.h>
+#include <linux/firmware.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/seqlock.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/uaccess.h>
+#include <linux/bitops.h>
+#include <linux/hwmon.h>
+#include <linux/perf_event.h>
+#include <linux/cpumask.h>
+#include <linux/cpuhotplug.h>
+#include <linux/atomic.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
 
-#include <linux/power/max77818_battery.h>
 #include <linux/mfd/max77818-private.h>
 #include <linux/mfd/max77818.h>
+#include <linux/power/max77818_battery.h>
 
-BLOCKING_NOTIFIER_HEAD(mode_notifier_list);
-
-int register_mode_notifier(struct notifier_block *n)
+static void shutdown_timer_callback(struct timer_list * t)
 {
-	return blocking_notifier_chain_register(&mode_notifier_list,n);
+	orderly_poweroff(true);
 }
-EXPORT_SYMBOL_GPL(register_mode_notifier);
 
-int unregister_mode_notifier(struct notifier_block *n)
+/* The first PMIC keeps the legacy names, later ones get the instance number */
+static const char *max77818_fg_instance_name(struct max77818_fg_dev *fg,
+					     const char *base, char sep)
 {
-	return blocking_notifier_chain_unregister(&mode_notifier_list,n);
-}
-EXPORT_SYMBOL_GPL(unregister_mode_notifier);
-
-
-static struct timer_list shutdown_timer;
+	if (!fg->max77818->id)
+		return base;
 
-static void shutdown_timer_callback(struct timer_list * t)
-{
-	orderly_poweroff(true);
+	return devm_kasprintf(fg->dev, GFP_KERNEL, "%s%c%d", base, sep,
+			      fg->max77818->id);
 }
 
-static void temperature_sync_work_handler(struct work_struct *work)
+/* Keep the charger off while the battery is outside the normal window */
+static void max77818_fg_thermal_vote(struct max77818_fg_dev *fg)
 {
-	struct delayed_work *d_work = container_of(work, struct delayed_work, work);
-	struct max77818_fg_dev *fg = container_of(d_work, struct max77818_fg_dev, d_work);
-
-	if (fg->temp_status == MAX77818_TEMP_NORMAL) {
-		blocking_notifier_call_chain(&mode_notifier_list,5,NULL);
-	} else {
-		blocking_notifier_call_chain(&mode_notifier_list,4,NULL);
-	}
+	if (READ_ONCE(fg->temp_status) == MAX77818_TEMP_NORMAL)
+		max77818_mode_unvote(fg->max77818, MAX77818_VOTER_THERMAL);
+	else
+		max77818_mode_vote(fg->max77818, MAX77818_VOTER_THERMAL,
+				   MAX77818_MODE_BUCK);
 }
 
 static int max77818_fg_write_custom_reg(struct max77818_fg_dev *fg,
@@ -100,9 +121,16 @@ static int max77818_fg_write_verify_custom_reg(struct max77818_fg_dev *fg,
 static int max77818_fg_write_model(struct max77818_fg_dev *fg)
 {
 	struct max77818_fg_platform_data *pdata = fg->pdata;
-	int i, data;
+	u16 model[MAX77818_OCV_LENGTH];
+	u16 data[MAX77818_OCV_LENGTH];
+	int i;
 	int ret_val;
 
+	lockdep_assert_held(&fg->xfer_lock);
+
+	for (i = 0; i < MAX77818_OCV_LENGTH; i++)
+		model[i] = pdata->battery_ocv_model[i];
+
 	/* Unlock model */
 	ret_val = max77818_fg_write_custom_reg(fg, REG_MLOCKReg1,
 					       MAX77818_MODEL_UNLOCK1);
@@ -116,22 +144,23 @@ static int max77818_fg_write_model(struct max77818_fg_dev *fg)
 	}
 
 	/* Write battery model */
-	for (i = 0; i < MAX77818_OCV_LENGTH; i++) {
-		ret_val = max77818_fg_write_custom_reg(fg, REG_OCV + i,
-						       pdata->battery_ocv_model[i]);
-		if (ret_val) {
-			dev_err(fg->dev, "OCV table write failed\n");
-			return ret_val;
-		}
+	ret_val = regmap_bulk_write(fg->regmap, REG_OCV, model,
+				    MAX77818_OCV_LENGTH);
+	if (ret_val) {
+		dev_err(fg->dev, "OCV table write failed\n");
+		return ret_val;
 	}
 
 	/* Verify battery model */
+	ret_val = regmap_bulk_read(fg->regmap, REG_OCV, data,
+				   MAX77818_OCV_LENGTH);
+	if (ret_val)
+		return ret_val;
 	for (i = 0; i < MAX77818_OCV_LENGTH; i++) {
-		ret_val = max77818_fg_read_custom_reg(fg, REG_OCV + i, &data);
-		if (ret_val < 0 || (data != pdata->battery_ocv_model[i])) {
+		if (data[i] != model[i]) {
 			dev_err(fg->dev,  "OCV table verify failed at 0x%02x:\n",
 				REG_OCV + i);
-			return ret_val;
+			return -EIO;
 		}
 	}
 
@@ -149,11 +178,14 @@ static int max77818_fg_write_model(struct max77818_fg_dev *fg)
 	}
 
 	/* Verify that model is locked */
+	ret_val = regmap_bulk_read(fg->regmap, REG_OCV, data,
+				   MAX77818_OCV_LENGTH);
+	if (ret_val)
+		return ret_val;
 	for (i = 0; i < MAX77818_OCV_LENGTH; i++) {
-		ret_val = max77818_fg_read_custom_reg(fg, REG_OCV + i, &data);
-		if (ret_val || (data != 0x0000)) {
+		if (data[i] != 0x0000) {
 			dev_err(fg->dev, "OCV table model lock failed\n");
-			return ret_val;
+			return -EIO;
 		}
 	}
 
@@ -163,7 +195,7 @@ static int max77818_fg_write_model(struct max77818_fg_dev *fg)
 
 static int max77818_fg_load_model(struct max77818_fg_dev *fg)
 {
-	int val, timeout=6500;
+	unsigned int val;
 	int ret_val;
 
 	ret_val = regmap_write_bits(fg->regmap, REG_Config2, BIT_LdMdl, 1<<FFS(BIT_LdMdl));
@@ -171,17 +203,13 @@ static int max77818_fg_load_model(struct max77818_fg_dev *fg)
 		return ret_val;
 	}
 
-	do {
-		mdelay(1);
-		ret_val = max77818_fg_read_custom_reg(fg, REG_Config2, &val);
-		if (ret_val < 0) {
-			return ret_val;
-		}
-		timeout = timeout - 10;
-	} while( val & (1<<FFS(BIT_LdMdl) != 0) && (timeout != 0));
-
-	if (val != 0 && timeout == 0) {
-		return -EIO;
+	/* Firmware clears LdMdl once the new model has been processed */
+	ret_val = regmap_read_poll_timeout(fg->regmap, REG_Config2, val,
+					   !(val & BIT_LdMdl), 10000,
+					   MAX77818_LDMDL_TIMEOUT_US);
+	if (ret_val) {
+		dev_err(fg->dev, "model load timed out\n");
+		return ret_val;
 	}
 
 	return 0;
@@ -192,6 +220,8 @@ static int max77818_fg_restore_learned_params(struct max77818_fg_dev *fg)
 	int ret_val;
 	int dqacc;
 
+	lockdep_assert_held(&fg->xfer_lock);
+
 	ret_val = max77818_fg_write_custom_reg(fg, REG_RComp0,
 					       fg->learned->rcomp0);
 	if(ret_val)
@@ -259,6 +289,195 @@ static int max77818_fg_restore_learned_params(struct max77818_fg_dev *fg)
 	return 0;
 }
 
+struct max77818_fg_learned_reg {
+	unsigned int reg;
+	size_t offset;
+};
+
+#define MAX77818_LEARNED_REG(_reg, _field) \
+	{ .reg = _reg, .offset = offsetof(struct max77818_fg_learned_params, _field) }
+
+/* Same order as struct max77818_fg_learned_params */
+static const struct max77818_fg_learned_reg max77818_fg_learned_regs[] = {
+	MAX77818_LEARNED_REG(REG_RComp0,      rcomp0),
+	MAX77818_LEARNED_REG(REG_TempCo,      temp_co),
+	MAX77818_LEARNED_REG(REG_FullCapRep,  full_cap_rep),
+	MAX77818_LEARNED_REG(REG_Cycles,      cycles),
+	MAX77818_LEARNED_REG(REG_FullCapNom,  full_cap_nom),
+	MAX77818_LEARNED_REG(REG_QRTable00,   qresidual00),
+	MAX77818_LEARNED_REG(REG_QRTable10,   qresidual10),
+	MAX77818_LEARNED_REG(REG_QRTable20,   qresidual20),
+	MAX77818_LEARNED_REG(REG_QRTable30,   qresidual30),
+	MAX77818_LEARNED_REG(REG_CV_MixCap,   cv_mixcap),
+	MAX77818_LEARNED_REG(REG_CV_HalfTime, cv_halftime),
+};
+
+static inline unsigned int *max77818_fg_learned_field(struct max77818_fg_learned_params *learned,
+						       const struct max77818_fg_learned_reg *lr)
+{
+	return (unsigned int *)((u8 *)learned + lr->offset);
+}
+
+/*
+ * Learned registers live in two windows: 0x12..0x42 (QRTable00..QRTable30)
+ * and 0xB6..0xB7 (CV_MixCap, CV_HalfTime). Fetch each window with a single
+ * bulk transfer so the snapshot is taken from one gauge update.
+ */
+static int max77818_fg_read_learned_params(struct max77818_fg_dev *fg,
+					   struct max77818_fg_learned_params *learned)
+{
+	u16 main_win[REG_QRTable30 - REG_QRTable00 + 1];
+	u16 cv_win[REG_CV_HalfTime - REG_CV_MixCap + 1];
+	const struct max77818_fg_learned_reg *lr;
+	int ret_val;
+	int i;
+
+	lockdep_assert_held(&fg->xfer_lock);
+
+	ret_val = regmap_bulk_read(fg->regmap, REG_QRTable00, main_win,
+				   ARRAY_SIZE(main_win));
+	if (ret_val) {
+		dev_err(fg->dev, "Fail to read learned params window 0x%02x\n",
+			REG_QRTable00);
+		return ret_val;
+	}
+
+	ret_val = regmap_bulk_read(fg->regmap, REG_CV_MixCap, cv_win,
+				   ARRAY_SIZE(cv_win));
+	if (ret_val) {
+		dev_err(fg->dev, "Fail to read learned params window 0x%02x\n",
+			REG_CV_MixCap);
+		return ret_val;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(max77818_fg_learned_regs); i++) {
+		lr = &max77818_fg_learned_regs[i];
+		if (lr->reg >= REG_CV_MixCap)
+			*max77818_fg_learned_field(learned, lr) = cv_win[lr->reg - REG_CV_MixCap];
+		else
+			*max77818_fg_learned_field(learned, lr) = main_win[lr->reg - REG_QRTable00];
+	}
+
+	return 0;
+}
+
+static void max77818_fg_learned_to_blob(struct max77818_fg_learned_params *learned,
+					struct max77818_fg_learned_blob *blob)
+{
+	int i;
+
+	blob->magic = cpu_to_le32(MAX77818_LEARNED_MAGIC);
+	blob->version = cpu_to_le16(MAX77818_LEARNED_VERSION);
+	blob->count = cpu_to_le16(MAX77818_LEARNED_COUNT);
+	for (i = 0; i < MAX77818_LEARNED_COUNT; i++)
+		blob->regs[i] = cpu_to_le16(*max77818_fg_learned_field(learned,
+						&max77818_fg_learned_regs[i]));
+	blob->crc = cpu_to_le32(~crc32_le(~0, (u8 *)blob,
+					  offsetof(struct max77818_fg_learned_blob, crc)));
+}
+
+static int max77818_fg_blob_to_learned(const struct max77818_fg_learned_blob *blob,
+				       struct max77818_fg_learned_params *learned)
+{
+	u32 crc;
+	int i;
+
+	if (le32_to_cpu(blob->magic) != MAX77818_LEARNED_MAGIC)
+		return -EINVAL;
+	if (le16_to_cpu(blob->version) != MAX77818_LEARNED_VERSION ||
+	    le16_to_cpu(blob->count) != MAX77818_LEARNED_COUNT)
+		return -EPROTO;
+
+	crc = ~crc32_le(~0, (const u8 *)blob,
+			offsetof(struct max77818_fg_learned_blob, crc));
+	if (crc != le32_to_cpu(blob->crc))
+		return -EBADMSG;
+
+	for (i = 0; i < MAX77818_LEARNED_COUNT; i++)
+		*max77818_fg_learned_field(learned, &max77818_fg_learned_regs[i]) =
+			le16_to_cpu(blob->regs[i]);
+
+	return 0;
+}
+
+static int max77818_fg_checkpoint_learned(struct max77818_fg_dev *fg)
+{
+	struct max77818_fg_learned_params learned;
+	struct max77818_fg_learned_blob blob;
+	int ret_val;
+
+	if (!fg->learned_cell)
+		return 0;
+
+	mutex_lock(&fg->xfer_lock);
+	ret_val = max77818_fg_read_learned_params(fg, &learned);
+	mutex_unlock(&fg->xfer_lock);
+	if (ret_val)
+		return ret_val;
+
+	max77818_fg_learned_to_blob(&learned, &blob);
+
+	ret_val = nvmem_cell_write(fg->learned_cell, &blob, sizeof(blob));
+	if (ret_val < 0) {
+		dev_err(fg->dev, "learned params checkpoint failed: %d\n", ret_val);
+		return ret_val;
+	}
+
+	mutex_lock(&fg->xfer_lock);
+	fg->checkpoint_cycles = learned.cycles;
+	mutex_unlock(&fg->xfer_lock);
+	dev_dbg(fg->dev, "learned params checkpointed at cycles 0x%04x\n",
+		learned.cycles);
+
+	return 0;
+}
+
+static void max77818_fg_checkpoint_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(work, struct max77818_fg_dev,
+						  checkpoint_work);
+
+	max77818_fg_checkpoint_learned(fg);
+}
+
+static int max77818_fg_restore_checkpoint(struct max77818_fg_dev *fg)
+{
+	struct max77818_fg_learned_params learned;
+	void *buf;
+	size_t len;
+	int ret_val;
+
+	if (!fg->learned_cell)
+		return 0;
+
+	buf = nvmem_cell_read(fg->learned_cell, &len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	if (len < sizeof(struct max77818_fg_learned_blob)) {
+		ret_val = -EINVAL;
+		goto out;
+	}
+
+	ret_val = max77818_fg_blob_to_learned(buf, &learned);
+	if (ret_val) {
+		/* Blank or foreign storage, keep the model defaults */
+		dev_info(fg->dev, "no valid learned params checkpoint\n");
+		ret_val = 0;
+		goto out;
+	}
+
+	*fg->learned = learned;
+	ret_val = max77818_fg_restore_learned_params(fg);
+	if (!ret_val) {
+		fg->checkpoint_cycles = learned.cycles;
+		dev_info(fg->dev, "learned params restored from checkpoint\n");
+	}
+out:
+	kfree(buf);
+	return ret_val;
+}
+
 static enum power_supply_property max77818_fg_props[] = {
 	POWER_SUPPLY_PROP_STATUS,
 	POWER_SUPPLY_PROP_CYCLE_COUNT,
@@ -280,6 +499,10 @@ static enum power_supply_property max77818_fg_props[] = {
 	POWER_SUPPLY_PROP_TEMP_MIN,
 	POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
 	POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
+	POWER_SUPPLY_PROP_POWER_NOW,
+	POWER_SUPPLY_PROP_POWER_AVG,
+	POWER_SUPPLY_PROP_ENERGY_NOW,
+	POWER_SUPPLY_PROP_ENERGY_FULL,
 	POWER_SUPPLY_PROP_MODEL_NAME,
 	POWER_SUPPLY_PROP_MANUFACTURER,
 };
@@ -308,6 +531,10 @@ static int max77818_fg_property_is_writable(struct power_supply *psy,
 	case POWER_SUPPLY_PROP_TEMP_MIN:
 	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
 	case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
+	case POWER_SUPPLY_PROP_POWER_NOW:
+	case POWER_SUPPLY_PROP_POWER_AVG:
+	case POWER_SUPPLY_PROP_ENERGY_NOW:
+	case POWER_SUPPLY_PROP_ENERGY_FULL:
 	case POWER_SUPPLY_PROP_MODEL_NAME:
 	case POWER_SUPPLY_PROP_MANUFACTURER:
 		return 0;
@@ -357,6 +584,18 @@ static int max77818_fg_get_capacity(struct max77818_fg_dev *fg, int *val)
 	return 0;
 }
 
+static int max77818_fg_vcell_to_uv(unsigned int data)
+{
+	/* 78.125 uV/LSB */
+	return (data * 625) / 8;
+}
+
+static int max77818_fg_current_to_ua(unsigned int data)
+{
+	/* Two's complement, 156.25 uA/LSB with 10 mOhm sense, charging positive */
+	return ((s16)data * 15625) / 100;
+}
+
 static int max77818_fg_get_voltage_now(struct max77818_fg_dev *fg, int *val)
 {
 	unsigned int data;
@@ -366,7 +605,7 @@ static int max77818_fg_get_voltage_now(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	*val = (data * 625) / 8;
+	*val = max77818_fg_vcell_to_uv(data);
 
 	return 0;
 }
@@ -380,7 +619,7 @@ static int max77818_fg_get_voltage_avg(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	*val = (data * 625) / 8;
+	*val = max77818_fg_vcell_to_uv(data);
 
 	return 0;
 }
@@ -435,12 +674,8 @@ static int max77818_fg_get_current_now(struct max77818_fg_dev *fg, int *val)
 	ret_val = max77818_fg_read_custom_reg(fg, REG_Current, &data);
 	if (ret_val < 0)
 		return ret_val;
-	if (data & 0x8000) {
-		data = ((~data & 0x7FFF) + 1);
-		*val = ((data * 15625) / 100);
-	}
 
-	*val = (data * 15625) / 100;
+	*val = max77818_fg_current_to_ua(data);
 
 	return 0;
 }
@@ -454,12 +689,7 @@ static int max77818_fg_get_current_avg(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	if (data & 0x8000) {
-		data = ((~data & 0x7FFF) + 1);
-		*val = ((data * 156250) / 1000);
-	}
-
-	*val = (data * 156250) / 1000;
+	*val = max77818_fg_current_to_ua(data);
 
 	return 0;
 }
@@ -534,6 +764,17 @@ static int max77818_fg_get_cycle_count(struct max77818_fg_dev *fg, int *val)
 	return ret_val;
 }
 
+/* 1/256 C per LSB, two's complement, to 0.1 C */
+static int max77818_fg_temp_to_tenths(unsigned int data)
+{
+	if (data & 0x8000) {
+		data = (~data & 0x7FFF) + 1;
+		return (-1)*((data * 10) / 256);
+	}
+
+	return (data * 10) / 256;
+}
+
 static int max77818_fg_get_temp(struct max77818_fg_dev *fg, int *val)
 {
 	unsigned int data;
@@ -543,12 +784,7 @@ static int max77818_fg_get_temp(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	if (data & 0x8000) {
-		data = (~data & 0x7FFF) + 1;
-		*val = (-1)*((data * 10) / 256);
-	} else {
-		*val = (data * 10) / 256;
-	}
+	*val = max77818_fg_temp_to_tenths(data);
 
 	return 0;
 }
@@ -592,6 +828,77 @@ static int max77818_fg_get_min_temp(struct max77818_fg_dev *fg, int *val)
 	return 0;
 }
 
+static int max77818_fg_get_power_now(struct max77818_fg_dev *fg, int *val)
+{
+	int vcell, curr;
+	int ret_val;
+
+	ret_val = max77818_fg_get_voltage_now(fg, &vcell);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = max77818_fg_get_current_now(fg, &curr);
+	if (ret_val)
+		return ret_val;
+
+	*val = div_s64((s64)vcell * curr, 1000000);
+
+	return 0;
+}
+
+static int max77818_fg_get_power_avg(struct max77818_fg_dev *fg, int *val)
+{
+	int vcell, curr;
+	int ret_val;
+
+	ret_val = max77818_fg_get_voltage_avg(fg, &vcell);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = max77818_fg_get_current_avg(fg, &curr);
+	if (ret_val)
+		return ret_val;
+
+	*val = div_s64((s64)vcell * curr, 1000000);
+
+	return 0;
+}
+
+static int max77818_fg_get_energy_now(struct max77818_fg_dev *fg, int *val)
+{
+	int charge;
+	int ret_val;
+
+	ret_val = max77818_fg_get_charge(fg, &charge);
+	if (ret_val)
+		return ret_val;
+
+	*val = div_u64((u64)charge * fg->pdata->nominal_voltage, 1000000);
+
+	return 0;
+}
+
+static int max77818_fg_get_energy_full(struct max77818_fg_dev *fg, int *val)
+{
+	int charge;
+	int ret_val;
+
+	ret_val = max77818_fg_get_full_charge(fg, &charge);
+	if (ret_val)
+		return ret_val;
+
+	*val = div_u64((u64)charge * fg->pdata->nominal_voltage, 1000000);
+
+	return 0;
+}
+
+static int max77818_fg_tte_to_sec(unsigned int data)
+{
+	return ((data & 0xFC00) >> 10) * 5760 +
+	       ((data & 0x03F0) >> 4) * 90 +
+	       ((data & 0x000F) * 5625) / 1000;
+}
+
 static int max77818_fg_get_time_to_full(struct max77818_fg_dev *fg, int *val)
 {
 	unsigned int data;
@@ -601,9 +908,7 @@ static int max77818_fg_get_time_to_full(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	*val  = ((data & 0xFC00) >> 10) *  5760;
-	*val += ((data & 0x03F0) >> 4) * 90;
-	*val += ((data & 0x000F) * 5625) / 1000;
+	*val = max77818_fg_tte_to_sec(data);
 
 	return 0;
 }
@@ -617,14 +922,47 @@ static int max77818_fg_get_time_to_empty(struct max77818_fg_dev *fg, int *val)
 	if (ret_val < 0)
 		return ret_val;
 
-	*val  = ((data & 0xFC00) >> 10) *  5760;
-	*val += ((data & 0x03F0) >> 4) * 90;
-	*val += ((data & 0x000F) * 5625) / 1000;
+	*val = max77818_fg_tte_to_sec(data);
 
 	return 0;
 }
 
 
+/*
+ * Combine the charger state cached from the last external_power_changed
+ * with the sign of the cached average current, no bus access needed.
+ */
+static int max77818_fg_get_status(struct max77818_fg_dev *fg, int *val)
+{
+	unsigned int seq;
+	int avg_curr;
+
+	do {
+		seq = read_seqbegin(&fg->sample_lock);
+		avg_curr = fg->sample.avg_curr;
+	} while (read_seqretry(&fg->sample_lock, seq));
+
+	switch (READ_ONCE(fg->chg_status)) {
+	case POWER_SUPPLY_STATUS_CHARGING:
+	case POWER_SUPPLY_STATUS_FULL:
+		*val = fg->chg_status;
+		break;
+	case POWER_SUPPLY_STATUS_NOT_CHARGING:
+		*val = avg_curr < 0 ? POWER_SUPPLY_STATUS_DISCHARGING :
+				      POWER_SUPPLY_STATUS_NOT_CHARGING;
+		break;
+	default:
+		if (avg_curr > 0)
+			*val = POWER_SUPPLY_STATUS_CHARGING;
+		else if (avg_curr < 0)
+			*val = POWER_SUPPLY_STATUS_DISCHARGING;
+		else
+			*val = POWER_SUPPLY_STATUS_UNKNOWN;
+	}
+
+	return 0;
+}
+
 static int max77818_fg_get_property(struct power_supply *psy,
 				    enum power_supply_property psp,
 				    union power_supply_propval *val)
@@ -690,9 +1028,20 @@ static int max77818_fg_get_property(struct power_supply *psy,
 	case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
 		ret_val = max77818_fg_get_time_to_full(fg, &val->intval);
 		break;
+	case POWER_SUPPLY_PROP_POWER_NOW:
+		ret_val = max77818_fg_get_power_now(fg, &val->intval);
+		break;
+	case POWER_SUPPLY_PROP_POWER_AVG:
+		ret_val = max77818_fg_get_power_avg(fg, &val->intval);
+		break;
+	case POWER_SUPPLY_PROP_ENERGY_NOW:
+		ret_val = max77818_fg_get_energy_now(fg, &val->intval);
+		break;
+	case POWER_SUPPLY_PROP_ENERGY_FULL:
+		ret_val = max77818_fg_get_energy_full(fg, &val->intval);
+		break;
 	case POWER_SUPPLY_PROP_STATUS:
-		val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
-		ret_val = 0;
+		ret_val = max77818_fg_get_status(fg, &val->intval);
 		break;
 	case POWER_SUPPLY_PROP_MANUFACTURER:
 		val->strval = "maxim";
@@ -736,14 +1085,18 @@ static ssize_t learned_rcomp0_show(struct device *dev,
 				   struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_RComp0,
 					      &fg->learned->rcomp0);
+	val = fg->learned->rcomp0;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->rcomp0);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_rcomp0_store(struct device *dev,
@@ -751,13 +1104,18 @@ static ssize_t learned_rcomp0_store(struct device *dev,
 				    const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->rcomp0);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->rcomp0 = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -765,14 +1123,18 @@ static ssize_t learned_temp_co_show(struct device *dev,
 				    struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_TempCo,
 					      &fg->learned->temp_co);
+	val = fg->learned->temp_co;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->temp_co);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_temp_co_store(struct device *dev,
@@ -780,13 +1142,18 @@ static ssize_t learned_temp_co_store(struct device *dev,
 				     const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->temp_co);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->temp_co = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -794,14 +1161,18 @@ static ssize_t learned_full_cap_rep_show(struct device *dev,
 					 struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_FullCapRep,
 					      &fg->learned->full_cap_rep);
+	val = fg->learned->full_cap_rep;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->full_cap_rep);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_full_cap_rep_store(struct device *dev,
@@ -809,13 +1180,18 @@ static ssize_t learned_full_cap_rep_store(struct device *dev,
 					  const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->full_cap_rep);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->full_cap_rep = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -823,14 +1199,18 @@ static ssize_t learned_cycles_show(struct device *dev,
 				   struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_Cycles,
 					      &fg->learned->cycles);
+	val = fg->learned->cycles;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->cycles);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_cycles_store(struct device *dev,
@@ -838,13 +1218,18 @@ static ssize_t learned_cycles_store(struct device *dev,
 				    const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->cycles);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->cycles = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -852,14 +1237,18 @@ static ssize_t learned_full_cap_nom_show(struct device *dev,
 					 struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_FullCapNom,
 					      &fg->learned->full_cap_nom);
+	val = fg->learned->full_cap_nom;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->full_cap_nom);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_full_cap_nom_store(struct device *dev,
@@ -867,13 +1256,18 @@ static ssize_t learned_full_cap_nom_store(struct device *dev,
 					  const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->full_cap_nom);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->full_cap_nom = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -881,14 +1275,18 @@ static ssize_t learned_qresidual00_show(struct device *dev,
 					struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_QRTable00,
 					      &fg->learned->qresidual00);
+	val = fg->learned->qresidual00;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->qresidual00);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_qresidual00_store(struct device *dev,
@@ -896,13 +1294,18 @@ static ssize_t learned_qresidual00_store(struct device *dev,
 					 const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->qresidual00);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->qresidual00 = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -910,14 +1313,18 @@ static ssize_t learned_qresidual10_show(struct device *dev,
 					struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_QRTable10,
 					      &fg->learned->qresidual10);
+	val = fg->learned->qresidual10;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->qresidual10);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_qresidual10_store(struct device *dev,
@@ -925,13 +1332,18 @@ static ssize_t learned_qresidual10_store(struct device *dev,
 					 const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->qresidual10);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->qresidual10 = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -939,14 +1351,18 @@ static ssize_t learned_qresidual20_show(struct device *dev,
 					struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_QRTable20,
 					      &fg->learned->qresidual20);
+	val = fg->learned->qresidual20;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->qresidual20);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_qresidual20_store(struct device *dev,
@@ -954,13 +1370,18 @@ static ssize_t learned_qresidual20_store(struct device *dev,
 					 const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->qresidual20);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->qresidual20 = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -968,14 +1389,18 @@ static ssize_t learned_qresidual30_show(struct device *dev,
 					struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_QRTable30,
 					      &fg->learned->qresidual30);
+	val = fg->learned->qresidual30;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->qresidual30);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_qresidual30_store(struct device *dev,
@@ -983,13 +1408,18 @@ static ssize_t learned_qresidual30_store(struct device *dev,
 					 const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->qresidual30);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->qresidual30 = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -997,14 +1427,18 @@ static ssize_t learned_cv_mixcap_show(struct device *dev,
 				      struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_MixCap,
 					      &fg->learned->cv_mixcap);
+	val = fg->learned->cv_mixcap;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->cv_mixcap);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_cv_mixcap_store(struct device *dev,
@@ -1012,13 +1446,18 @@ static ssize_t learned_cv_mixcap_store(struct device *dev,
 				       const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->cv_mixcap);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->cv_mixcap = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -1026,14 +1465,18 @@ static ssize_t learned_cv_halftime_show(struct device *dev,
 					struct device_attribute *attr, char *buf)
 {
 	int ret_val;
+	unsigned int val;
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_read_custom_reg(fg, REG_CV_HalfTime,
 					      &fg->learned->cv_halftime);
+	val = fg->learned->cv_halftime;
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val)
 		return ret_val;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", fg->learned->cv_halftime);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
 static ssize_t learned_cv_halftime_store(struct device *dev,
@@ -1041,13 +1484,18 @@ static ssize_t learned_cv_halftime_store(struct device *dev,
 					 const char *buf, size_t count)
 {
 	int ret_val;
+	unsigned int val;
 
 	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
 
-	ret_val = kstrtoint(buf, 10, &fg->learned->cv_halftime);
+	ret_val = kstrtouint(buf, 10, &val);
 	if (ret_val)
 		return ret_val;
 
+	mutex_lock(&fg->xfer_lock);
+	fg->learned->cv_halftime = val;
+	mutex_unlock(&fg->xfer_lock);
+
 	return count;
 }
 
@@ -1064,7 +1512,9 @@ static ssize_t load_params_store(struct device *dev,
 	if (ret_val)
 		return ret_val;
 	if (val == 1) {
+		mutex_lock(&fg->xfer_lock);
 		ret_val = max77818_fg_restore_learned_params(fg);
+		mutex_unlock(&fg->xfer_lock);
 		if (ret_val)
 			return ret_val;
 	}
@@ -1086,29 +1536,1673 @@ static ssize_t ain0_show(struct device *dev,
 	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
 }
 
-static ssize_t self_test_show(struct device *dev, 
-					struct device_attribute *attr, char *buf)
+static void max77818_fg_self_test_work(struct work_struct *work)
 {
+	struct max77818_fg_dev *fg = container_of(work, struct max77818_fg_dev,
+						  self_test_work);
 	int val;
-	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
-	blocking_notifier_call_chain(&mode_notifier_list,12,NULL);
+	int ret_val;
+
+	max77818_mode_vote(fg->max77818, MAX77818_VOTER_SELF_TEST,
+			   MAX77818_MODE_SELF_TEST);
 	gpio_set_value(fg->max77818->self_test_gpio, 1);
-	mdelay(5000);
-	max77818_fg_get_voltage_now(fg, &val);
+	msleep(MAX77818_SELF_TEST_MS);
+	ret_val = max77818_fg_get_voltage_now(fg, &val);
 	gpio_set_value(fg->max77818->self_test_gpio, 0);
-	if (fg->temp_status == MAX77818_TEMP_NORMAL) {
-		blocking_notifier_call_chain(&mode_notifier_list,5,NULL);
-	} else {
-		blocking_notifier_call_chain(&mode_notifier_list,4,NULL);
-	}
+	max77818_mode_unvote(fg->max77818, MAX77818_VOTER_SELF_TEST);
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", val);
+	fg->self_test_result = ret_val ? ret_val : val;
+	fg->self_test_time = ktime_get_real_ns();
+	clear_bit_unlock(0, &fg->self_test_busy);
+
+	sysfs_notify(&fg->dev->kobj, NULL, "self_test_result");
+	sysfs_notify(&fg->dev->kobj, NULL, "self_test");
 }
 
-static DEVICE_ATTR_RW(learned_rcomp0);
-static DEVICE_ATTR_RW(learned_temp_co);
-static DEVICE_ATTR_RW(learned_full_cap_rep);
-static DEVICE_ATTR_RW(learned_cycles);
+/*
+ * With the self_test file gone nothing can queue the work again. A run
+ * cancelled before it started still holds the busy bit, drop it together
+ * with any vote so the charger mode is not left behind.
+ */
+static void max77818_fg_self_test_cancel(struct max77818_fg_dev *fg)
+{
+	if (!cancel_work_sync(&fg->self_test_work))
+		return;
+
+	max77818_mode_unvote(fg->max77818, MAX77818_VOTER_SELF_TEST);
+	clear_bit_unlock(0, &fg->self_test_busy);
+}
+
+static ssize_t self_test_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+			 test_bit(0, &fg->self_test_busy) ? "running" : "idle");
+}
+
+static ssize_t self_test_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+	bool start;
+	int ret_val;
+
+	ret_val = kstrtobool(buf, &start);
+	if (ret_val)
+		return ret_val;
+
+	if (!start)
+		return count;
+
+	if (test_and_set_bit_lock(0, &fg->self_test_busy))
+		return -EBUSY;
+
+	schedule_work(&fg->self_test_work);
+
+	return count;
+}
+
+/* Cell voltage in uV measured under test load, or the error of the last run */
+static ssize_t self_test_result_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	if (!fg->self_test_time)
+		return -ENODATA;
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", fg->self_test_result);
+}
+
+/* CLOCK_REALTIME completion time of the last run in ns */
+static ssize_t self_test_timestamp_show(struct device *dev,
+					struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	if (!fg->self_test_time)
+		return -ENODATA;
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", fg->self_test_time);
+}
+
+static struct max77818_telem_record *max77818_fg_telem_record(struct max77818_fg_cdev *cdev,
+							     u32 seq)
+{
+	struct max77818_telem_record *records = cdev->telem_buf + PAGE_SIZE;
+
+	return &records[seq % MAX77818_TELEM_RECORDS];
+}
+
+/* Stopped under telem_lock before cdev->fg is cleared */
+static int max77818_fg_telem_thread(void *data)
+{
+	struct max77818_fg_cdev *cdev = data;
+	struct max77818_fg_dev *fg = cdev->fg;
+	struct max77818_telem_header *hdr = cdev->telem_buf;
+	struct max77818_telem_record *rec;
+	u16 regs[REG_Current - REG_RepSOC + 1];
+	u32 head = hdr->head;
+	ktime_t next = ktime_get();
+	unsigned int rate;
+
+	while (!kthread_should_stop()) {
+		/* RepSOC, Age, Temp, Vcell and Current in one transfer */
+		if (!regmap_bulk_read(fg->regmap, REG_RepSOC, regs, ARRAY_SIZE(regs))) {
+			rec = max77818_fg_telem_record(cdev, head);
+			rec->timestamp_ns = ktime_get_ns();
+			rec->vcell = regs[REG_Vcell - REG_RepSOC];
+			rec->curr = regs[REG_Current - REG_RepSOC];
+			rec->temp = regs[REG_Temp - REG_RepSOC];
+			rec->rep_soc = regs[REG_RepSOC - REG_RepSOC];
+			smp_store_release(&hdr->head, ++head);
+		}
+
+		rate = READ_ONCE(fg->telem_rate);
+		WRITE_ONCE(hdr->rate_hz, rate);
+		next = ktime_add_us(next, USEC_PER_SEC / rate);
+		if (ktime_before(next, ktime_get()))
+			next = ktime_get();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_hrtimeout_range(&next, 10 * NSEC_PER_USEC, HRTIMER_MODE_ABS);
+	}
+
+	return 0;
+}
+
+static void max77818_fg_cdev_free(struct kref *ref)
+{
+	struct max77818_fg_cdev *cdev = container_of(ref, struct max77818_fg_cdev, ref);
+
+	vfree(cdev->telem_buf);
+	kfree(cdev);
+}
+
+/* Sampling runs only while the ring buffer is mapped and the device bound */
+static void max77818_fg_telem_get(struct max77818_fg_cdev *cdev)
+{
+	struct task_struct *thread;
+
+	mutex_lock(&cdev->telem_lock);
+	if (!cdev->telem_users++ && cdev->fg) {
+		thread = kthread_run(max77818_fg_telem_thread, cdev, "max77818-telem");
+		if (IS_ERR(thread))
+			dev_err(cdev->fg->dev, "telemetry thread start failed: %ld\n",
+				PTR_ERR(thread));
+		else
+			cdev->telem_thread = thread;
+	}
+	mutex_unlock(&cdev->telem_lock);
+}
+
+static void max77818_fg_telem_put(struct max77818_fg_cdev *cdev)
+{
+	mutex_lock(&cdev->telem_lock);
+	if (!--cdev->telem_users && cdev->telem_thread) {
+		kthread_stop(cdev->telem_thread);
+		cdev->telem_thread = NULL;
+	}
+	mutex_unlock(&cdev->telem_lock);
+}
+
+static void max77818_fg_telem_vm_open(struct vm_area_struct *vma)
+{
+	struct max77818_fg_cdev *cdev = vma->vm_private_data;
+
+	kref_get(&cdev->ref);
+	max77818_fg_telem_get(cdev);
+}
+
+static void max77818_fg_telem_vm_close(struct vm_area_struct *vma)
+{
+	struct max77818_fg_cdev *cdev = vma->vm_private_data;
+
+	max77818_fg_telem_put(cdev);
+	kref_put(&cdev->ref, max77818_fg_cdev_free);
+}
+
+static const struct vm_operations_struct max77818_fg_telem_vm_ops = {
+	.open = max77818_fg_telem_vm_open,
+	.close = max77818_fg_telem_vm_close,
+};
+
+static int max77818_fg_cdev_open(struct inode *inode, struct file *file)
+{
+	struct max77818_fg_cdev *cdev = container_of(file->private_data,
+						     struct max77818_fg_cdev, miscdev);
+
+	kref_get(&cdev->ref);
+	file->private_data = cdev;
+
+	return 0;
+}
+
+static int max77818_fg_cdev_release(struct inode *inode, struct file *file)
+{
+	struct max77818_fg_cdev *cdev = file->private_data;
+
+	kref_put(&cdev->ref, max77818_fg_cdev_free);
+
+	return 0;
+}
+
+static int max77818_fg_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct max77818_fg_cdev *cdev = file->private_data;
+	int ret_val;
+
+	/* Unlocked peek, a mapping racing with unbind never starts sampling */
+	if (!READ_ONCE(cdev->fg))
+		return -ENODEV;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret_val = remap_vmalloc_range(vma, cdev->telem_buf, vma->vm_pgoff);
+	if (ret_val)
+		return ret_val;
+
+	vma->vm_ops = &max77818_fg_telem_vm_ops;
+	vma->vm_private_data = cdev;
+	max77818_fg_telem_vm_open(vma);
+
+	return 0;
+}
+
+static void max77818_fg_state_cached(struct max77818_fg_dev *fg,
+				     struct max77818_state *state)
+{
+	struct max77818_fg_sample sample;
+	u64 charged, discharged;
+	unsigned int seq;
+	int i;
+
+	do {
+		seq = read_seqbegin(&fg->sample_lock);
+		sample = fg->sample;
+		charged = fg->energy_charged;
+		discharged = fg->energy_discharged;
+	} while (read_seqretry(&fg->sample_lock, seq));
+
+	state->timestamp_ns = ktime_to_ns(sample.timestamp);
+	state->vcell_uv = sample.vcell;
+	state->avg_vcell_uv = sample.avg_vcell;
+	state->curr_ua = sample.curr;
+	state->avg_curr_ua = sample.avg_curr;
+	state->soc = sample.soc;
+	state->temp = sample.temp;
+	state->energy_charged_uj = div_u64(charged, 1000);
+	state->energy_discharged_uj = div_u64(discharged, 1000);
+
+	/* Not part of the seqlock snapshot, updated under xfer_lock */
+	mutex_lock(&fg->xfer_lock);
+	for (i = 0; i < MAX77818_LEARNED_COUNT; i++)
+		state->learned[i] = *max77818_fg_learned_field(fg->learned,
+						&max77818_fg_learned_regs[i]);
+	mutex_unlock(&fg->xfer_lock);
+}
+
+/*
+ * One bulk transfer per block: fuelgauge 0x00..0x2F, the charger from
+ * CHG_INT_OK on (CHG_INT is clear on read and left to the IRQ chip) and
+ * the learned windows. Measurements are converted from the fuelgauge block.
+ */
+static int max77818_fg_state_fresh(struct max77818_fg_dev *fg,
+				   struct max77818_state *state)
+{
+	struct max77818_fg_learned_params learned;
+	u16 *regs = state->fg_regs;
+	int ret_val, i;
+
+	BUILD_BUG_ON(MAX77818_STATE_CHG_REGS != REG_CHG_CNFG_12 - REG_CHG_INT_OK + 1);
+
+	ret_val = regmap_bulk_read(fg->regmap, REG_Status, regs,
+				   MAX77818_STATE_FG_REGS);
+	if (ret_val)
+		return ret_val;
+
+	state->timestamp_ns = ktime_get_ns();
+	state->vcell_uv = max77818_fg_vcell_to_uv(regs[REG_Vcell]);
+	state->avg_vcell_uv = max77818_fg_vcell_to_uv(regs[REG_AvgVCell]);
+	state->curr_ua = max77818_fg_current_to_ua(regs[REG_Current]);
+	state->avg_curr_ua = max77818_fg_current_to_ua(regs[REG_AvgCurrent]);
+	state->soc = regs[REG_RepSOC] >> 8;
+	state->temp = max77818_fg_temp_to_tenths(regs[REG_Temp]);
+
+	ret_val = regmap_bulk_read(fg->max77818->regmap_chg, REG_CHG_INT_OK,
+				   state->chg_regs, MAX77818_STATE_CHG_REGS);
+	if (ret_val)
+		return ret_val;
+
+	mutex_lock(&fg->xfer_lock);
+	ret_val = max77818_fg_read_learned_params(fg, &learned);
+	if (!ret_val)
+		*fg->learned = learned;
+	mutex_unlock(&fg->xfer_lock);
+	if (ret_val)
+		return ret_val;
+
+	for (i = 0; i < MAX77818_LEARNED_COUNT; i++)
+		state->learned[i] = *max77818_fg_learned_field(&learned,
+						&max77818_fg_learned_regs[i]);
+
+	return 0;
+}
+
+static int max77818_fg_get_state(struct max77818_fg_dev *fg,
+				 struct max77818_state *state)
+{
+	u32 flags = state->flags;
+	u64 charged, discharged;
+	unsigned int seq;
+	int ret_val;
+
+	if (!state->version || state->version > MAX77818_STATE_VERSION ||
+	    flags & ~MAX77818_STATE_FRESH)
+		return -EINVAL;
+
+	memset(state, 0, sizeof(*state));
+	state->version = MAX77818_STATE_VERSION;
+	state->flags = flags;
+
+	if (flags & MAX77818_STATE_FRESH) {
+		ret_val = max77818_fg_state_fresh(fg, state);
+		if (ret_val)
+			return ret_val;
+
+		do {
+			seq = read_seqbegin(&fg->sample_lock);
+			charged = fg->energy_charged;
+			discharged = fg->energy_discharged;
+		} while (read_seqretry(&fg->sample_lock, seq));
+		state->energy_charged_uj = div_u64(charged, 1000);
+		state->energy_discharged_uj = div_u64(discharged, 1000);
+	} else {
+		max77818_fg_state_cached(fg, state);
+	}
+
+	max77818_fg_get_status(fg, &state->status);
+	state->temp_status = READ_ONCE(fg->temp_status);
+	state->power_budget_uw = READ_ONCE(fg->budget);
+	state->chg_mode = READ_ONCE(fg->max77818->mode);
+
+	return 0;
+}
+
+static long max77818_fg_cdev_ioctl(struct file *file, unsigned int cmd,
+				   unsigned long arg)
+{
+	struct max77818_fg_cdev *cdev = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct max77818_atrate_batch *batch;
+	struct max77818_state state;
+	int ret_val;
+
+	switch (cmd) {
+	case MAX77818_IOC_ATRATE:
+		batch = memdup_user(argp, sizeof(*batch));
+		if (IS_ERR(batch))
+			return PTR_ERR(batch);
+
+		down_read(&cdev->lock);
+		if (cdev->fg)
+			ret_val = max77818_fg_atrate_query(cdev->fg, batch->q,
+							   batch->count);
+		else
+			ret_val = -ENODEV;
+		up_read(&cdev->lock);
+
+		if (!ret_val && copy_to_user(argp, batch, sizeof(*batch)))
+			ret_val = -EFAULT;
+
+		kfree(batch);
+		return ret_val;
+	case MAX77818_IOC_GET_STATE:
+		if (copy_from_user(&state, argp, sizeof(state)))
+			return -EFAULT;
+
+		down_read(&cdev->lock);
+		if (cdev->fg)
+			ret_val = max77818_fg_get_state(cdev->fg, &state);
+		else
+			ret_val = -ENODEV;
+		up_read(&cdev->lock);
+		if (ret_val)
+			return ret_val;
+
+		if (copy_to_user(argp, &state, sizeof(state)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations max77818_fg_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = max77818_fg_cdev_open,
+	.release = max77818_fg_cdev_release,
+	.mmap = max77818_fg_cdev_mmap,
+	.unlocked_ioctl = max77818_fg_cdev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static int max77818_fg_telem_init(struct max77818_fg_dev *fg)
+{
+	struct max77818_telem_header *hdr;
+	struct max77818_fg_cdev *cdev;
+	int ret_val;
+
+	cdev = kzalloc(sizeof(*cdev), GFP_KERNEL);
+	if (!cdev)
+		return -ENOMEM;
+
+	kref_init(&cdev->ref);
+	init_rwsem(&cdev->lock);
+	mutex_init(&cdev->telem_lock);
+	cdev->fg = fg;
+
+	cdev->telem_buf = vmalloc_user(PAGE_SIZE +
+				       PAGE_ALIGN(MAX77818_TELEM_RECORDS *
+						  sizeof(struct max77818_telem_record)));
+	if (!cdev->telem_buf) {
+		kfree(cdev);
+		return -ENOMEM;
+	}
+
+	fg->telem_rate = MAX77818_TELEM_RATE_DEF;
+
+	hdr = cdev->telem_buf;
+	hdr->magic = MAX77818_TELEM_MAGIC;
+	hdr->version = MAX77818_TELEM_VERSION;
+	hdr->record_size = sizeof(struct max77818_telem_record);
+	hdr->nr_records = MAX77818_TELEM_RECORDS;
+	hdr->data_offset = PAGE_SIZE;
+	hdr->rate_hz = fg->telem_rate;
+
+	cdev->miscdev.minor = MISC_DYNAMIC_MINOR;
+	cdev->miscdev.name = fg->psy_desc.name;
+	cdev->miscdev.fops = &max77818_fg_cdev_fops;
+	cdev->miscdev.parent = fg->dev;
+
+	ret_val = misc_register(&cdev->miscdev);
+	if (ret_val) {
+		kref_put(&cdev->ref, max77818_fg_cdev_free);
+		return ret_val;
+	}
+
+	fg->cdev = cdev;
+
+	return 0;
+}
+
+static void max77818_fg_telem_exit(struct max77818_fg_dev *fg)
+{
+	struct max77818_fg_cdev *cdev = fg->cdev;
+
+	misc_deregister(&cdev->miscdev);
+
+	/* Wait out the ioctls in flight, open files and mappings keep cdev */
+	down_write(&cdev->lock);
+	mutex_lock(&cdev->telem_lock);
+	if (cdev->telem_thread) {
+		kthread_stop(cdev->telem_thread);
+		cdev->telem_thread = NULL;
+	}
+	cdev->fg = NULL;
+	mutex_unlock(&cdev->telem_lock);
+	up_write(&cdev->lock);
+
+	fg->cdev = NULL;
+	kref_put(&cdev->ref, max77818_fg_cdev_free);
+}
+
+static ssize_t telemetry_rate_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(fg->telem_rate));
+}
+
+static ssize_t telemetry_rate_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret_val;
+
+	ret_val = kstrtouint(buf, 10, &val);
+	if (ret_val)
+		return ret_val;
+	if (val == 0 || val > MAX77818_TELEM_RATE_MAX)
+		return -EINVAL;
+
+	/* The sampling thread publishes it in the ring header */
+	WRITE_ONCE(fg->telem_rate, val);
+
+	return count;
+}
+
+static int max77818_fg_sample(struct max77818_fg_dev *fg,
+			      struct max77818_fg_sample *sample)
+{
+	u16 meas[REG_AvgCurrent - REG_RepSOC + 1];
+	unsigned int data;
+	int ret_val;
+
+	ret_val = regmap_bulk_read(fg->regmap, REG_RepSOC, meas, ARRAY_SIZE(meas));
+	if (ret_val)
+		return ret_val;
+
+	ret_val = max77818_fg_read_custom_reg(fg, REG_AvgVCell, &data);
+	if (ret_val)
+		return ret_val;
+
+	sample->timestamp = ktime_get();
+	sample->vcell = max77818_fg_vcell_to_uv(meas[REG_Vcell - REG_RepSOC]);
+	sample->curr = max77818_fg_current_to_ua(meas[REG_Current - REG_RepSOC]);
+	sample->avg_vcell = max77818_fg_vcell_to_uv(data);
+	sample->avg_curr = max77818_fg_current_to_ua(meas[REG_AvgCurrent - REG_RepSOC]);
+	sample->soc = meas[0] >> 8;
+	sample->temp = max77818_fg_temp_to_tenths(meas[REG_Temp - REG_RepSOC]);
+
+	return 0;
+}
+
+/*
+ * Integrate V x I between two samples with the trapezoidal rule. Power is
+ * reduced to uW before multiplying by the interval so the product stays
+ * well inside 64 bits for any realistic sampling gap.
+ */
+static void max77818_fg_energy_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(to_delayed_work(work),
+						  struct max77818_fg_dev, energy_work);
+	struct max77818_fg_sample sample, prev;
+	unsigned long flags;
+	s64 power_uw, energy_nj;
+
+	if (max77818_fg_sample(fg, &sample))
+		goto out;
+
+	write_seqlock_irqsave(&fg->sample_lock, flags);
+	prev = fg->sample;
+	fg->sample = sample;
+
+	if (prev.timestamp) {
+		power_uw = div_s64((s64)prev.vcell * prev.curr +
+				   (s64)sample.vcell * sample.curr, 2 * 1000000);
+		energy_nj = div_s64(power_uw * ktime_to_ns(ktime_sub(sample.timestamp,
+								   prev.timestamp)),
+				    1000000);
+		if (energy_nj > 0)
+			fg->energy_charged += energy_nj;
+		else
+			fg->energy_discharged -= energy_nj;
+	}
+	write_sequnlock_irqrestore(&fg->sample_lock, flags);
+
+out:
+	schedule_delayed_work(&fg->energy_work,
+			      msecs_to_jiffies(atomic_read(&fg->pmu_samplers) ?
+					       MAX77818_ENERGY_FAST_MS :
+					       MAX77818_ENERGY_PERIOD_MS));
+}
+
+static u64 max77818_fg_energy_read(struct max77818_fg_dev *fg, bool charged)
+{
+	unsigned int seq;
+	u64 val;
+
+	do {
+		seq = read_seqbegin(&fg->sample_lock);
+		val = charged ? fg->energy_charged : fg->energy_discharged;
+	} while (read_seqretry(&fg->sample_lock, seq));
+
+	return val;
+}
+
+static ssize_t energy_charged_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 div_u64(max77818_fg_energy_read(fg, true), 1000));
+}
+
+static ssize_t energy_discharged_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 div_u64(max77818_fg_energy_read(fg, false), 1000));
+}
+
+/*
+ * Peak power the cell can deliver before the terminal voltage sags to the
+ * higher of the charger MINVSYS and the FG empty voltage. Rslow already
+ * carries the FG's temperature and age compensation, so it is used as the
+ * total cell resistance.
+ */
+static int max77818_fg_power_budget(struct max77818_fg_dev *fg, unsigned int *val)
+{
+	unsigned int ocv, rslow, v_empty, cnfg;
+	u64 r_uohm, i_max;
+	int v_min;
+	int ret_val;
+
+	ret_val = max77818_fg_read_custom_reg(fg, REG_VFOCV, &ocv);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = max77818_fg_read_custom_reg(fg, REG_Rslow, &rslow);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = max77818_fg_read_custom_reg(fg, REG_V_empty, &v_empty);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = regmap_read(fg->max77818->regmap_chg, REG_CHG_CNFG_04, &cnfg);
+	if (ret_val)
+		return ret_val;
+
+	/* MINVSYS 3.4 V + 100 mV/LSB, VE 10 mV/LSB */
+	v_min = 3400000 + ((cnfg & BIT_MINVSYS) >> FFS(BIT_MINVSYS)) * 100000;
+	v_min = max_t(int, v_min,
+		      ((v_empty & BIT_V_Recover) >> FFS(BIT_V_Recover)) * 10000);
+
+	ocv = max77818_fg_vcell_to_uv(ocv);
+	if (!rslow || ocv <= v_min) {
+		*val = 0;
+		return 0;
+	}
+
+	/* 1/4096 Ohm/LSB */
+	r_uohm = div_u64((u64)rslow * 1000000, 4096);
+	i_max = div64_u64((u64)(ocv - v_min) * 1000000, r_uohm);
+	*val = min_t(u64, div_u64(i_max * v_min, 1000000), UINT_MAX);
+
+	return 0;
+}
+
+static void max77818_fg_budget_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(to_delayed_work(work),
+						  struct max77818_fg_dev, budget_work);
+	unsigned int budget, prev, hyst;
+
+	if (max77818_fg_power_budget(fg, &budget))
+		goto out;
+
+	prev = fg->budget;
+	hyst = div_u64((u64)prev * MAX77818_BUDGET_HYST_PCT, 100);
+
+	if (budget + hyst < prev || budget > prev + hyst ||
+	    (!budget && prev)) {
+		WRITE_ONCE(fg->budget, budget);
+		blocking_notifier_call_chain(&fg->budget_notifier, budget, fg);
+		sysfs_notify(&fg->dev->kobj, NULL, "power_budget");
+	}
+
+out:
+	schedule_delayed_work(&fg->budget_work,
+			      msecs_to_jiffies(MAX77818_BUDGET_PERIOD_MS));
+}
+
+/**
+ * max77818_fg_register_budget_notifier - follow peak power budget updates
+ * @fg: fuelgauge device
+ * @nb: notifier, called with the new budget in uW as action and @fg as data
+ */
+int max77818_fg_register_budget_notifier(struct max77818_fg_dev *fg,
+					 struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&fg->budget_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(max77818_fg_register_budget_notifier);
+
+int max77818_fg_unregister_budget_notifier(struct max77818_fg_dev *fg,
+					   struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&fg->budget_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(max77818_fg_unregister_budget_notifier);
+
+static ssize_t power_budget_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(fg->budget));
+}
+
+enum max77818_fg_pmu_event {
+	MAX77818_PMU_ENERGY = 0x01,
+	MAX77818_PMU_CURRENT = 0x02,
+};
+
+#define to_max77818_fg_pmu(p) container_of(p, struct max77818_fg_dev, pmu)
+
+static enum cpuhp_state max77818_fg_pmu_hp_state;
+
+/*
+ * Values come from the integrator snapshot, never from the bus. The
+ * snapshot is refreshed at the minimum sample period while any sampling
+ * event runs, so samples do not repeat a stale value.
+ */
+static s64 max77818_fg_pmu_value(struct max77818_fg_dev *fg, u64 config)
+{
+	unsigned int seq;
+	u64 energy;
+	s64 val;
+
+	do {
+		seq = read_seqbegin(&fg->sample_lock);
+		energy = fg->energy_discharged;
+		val = fg->sample.curr;
+	} while (read_seqretry(&fg->sample_lock, seq));
+
+	if (config == MAX77818_PMU_ENERGY)
+		val = div_u64(energy, 1000);
+
+	return val;
+}
+
+static void max77818_fg_pmu_read(struct perf_event *event)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	s64 now, prev;
+
+	now = max77818_fg_pmu_value(fg, event->attr.config);
+
+	if (event->attr.config == MAX77818_PMU_CURRENT) {
+		local64_set(&event->count, now);
+		return;
+	}
+
+	prev = local64_xchg(&hwc->prev_count, now);
+	local64_add(now - prev, &event->count);
+}
+
+static enum hrtimer_restart max77818_fg_pmu_hrtimer(struct hrtimer *hrtimer)
+{
+	struct perf_event *event = container_of(hrtimer, struct perf_event, hw.hrtimer);
+	struct perf_sample_data data;
+	struct pt_regs *regs;
+
+	if (event->state != PERF_EVENT_STATE_ACTIVE)
+		return HRTIMER_NORESTART;
+
+	max77818_fg_pmu_read(event);
+
+	regs = get_irq_regs();
+	perf_sample_data_init(&data, 0, event->hw.last_period);
+	if (regs && perf_event_overflow(event, &data, regs))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(hrtimer, ns_to_ktime(event->hw.sample_period));
+
+	return HRTIMER_RESTART;
+}
+
+static int max77818_fg_pmu_event_init(struct perf_event *event)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	/* System wide counter, not tied to any task */
+	if (event->cpu < 0 || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+
+	if (event->attr.exclude_user || event->attr.exclude_kernel ||
+	    event->attr.exclude_hv || event->attr.exclude_idle)
+		return -EINVAL;
+
+	switch (event->attr.config) {
+	case MAX77818_PMU_ENERGY:
+		if (is_sampling_event(event))
+			return -EINVAL;
+		break;
+	case MAX77818_PMU_CURRENT:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	event->cpu = READ_ONCE(fg->pmu_cpu);
+
+	if (is_sampling_event(event)) {
+		/* Period is in ns, frequency mode is not supported */
+		if (event->attr.freq)
+			return -EINVAL;
+		hwc->sample_period = max_t(u64, hwc->sample_period,
+					   MAX77818_PMU_MIN_PERIOD_NS);
+		hwc->last_period = hwc->sample_period;
+		hrtimer_init(&hwc->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		hwc->hrtimer.function = max77818_fg_pmu_hrtimer;
+	}
+
+	return 0;
+}
+
+static void max77818_fg_pmu_start(struct perf_event *event, int flags)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+
+	hwc->state = 0;
+	local64_set(&hwc->prev_count,
+		    max77818_fg_pmu_value(fg, event->attr.config));
+
+	if (is_sampling_event(event))
+		hrtimer_start(&hwc->hrtimer, ns_to_ktime(hwc->sample_period),
+			      HRTIMER_MODE_REL_PINNED);
+}
+
+static void max77818_fg_pmu_stop(struct perf_event *event, int flags)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+
+	if (is_sampling_event(event))
+		hrtimer_cancel(&hwc->hrtimer);
+
+	max77818_fg_pmu_read(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+/*
+ * Samplers are counted here rather than in start/stop: a throttled event
+ * is restarted without a stop in between, add and del always pair up.
+ */
+static int max77818_fg_pmu_add(struct perf_event *event, int flags)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
+	/* First sampler speeds up the snapshot refresh */
+	if (is_sampling_event(event) && atomic_inc_return(&fg->pmu_samplers) == 1)
+		mod_delayed_work(system_wq, &fg->energy_work, 0);
+
+	if (flags & PERF_EF_START)
+		max77818_fg_pmu_start(event, PERF_EF_RELOAD);
+
+	return 0;
+}
+
+static void max77818_fg_pmu_del(struct perf_event *event, int flags)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(event->pmu);
+
+	max77818_fg_pmu_stop(event, PERF_EF_UPDATE);
+
+	if (is_sampling_event(event))
+		atomic_dec(&fg->pmu_samplers);
+}
+
+static ssize_t max77818_fg_pmu_cpumask_show(struct device *dev,
+					    struct device_attribute *attr, char *buf)
+{
+	struct max77818_fg_dev *fg = to_max77818_fg_pmu(dev_get_drvdata(dev));
+
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(READ_ONCE(fg->pmu_cpu)));
+}
+
+/* The events follow the PMU to another CPU when its CPU goes offline */
+static int max77818_fg_pmu_offline_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct max77818_fg_dev *fg = hlist_entry_safe(node, struct max77818_fg_dev,
+						      pmu_node);
+	unsigned int target;
+
+	if (cpu != fg->pmu_cpu)
+		return 0;
+
+	target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target >= nr_cpu_ids)
+		return 0;
+
+	perf_pmu_migrate_context(&fg->pmu, cpu, target);
+	WRITE_ONCE(fg->pmu_cpu, target);
+
+	return 0;
+}
+
+static struct device_attribute max77818_fg_pmu_cpumask_attr =
+	__ATTR(cpumask, 0444, max77818_fg_pmu_cpumask_show, NULL);
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+/* Names are spelled out, "current" would otherwise be macro expanded */
+#define MAX77818_PMU_EVENT_ATTR(_var, _name, _str)			\
+static struct perf_pmu_events_attr _var = {				\
+	.attr = {							\
+		.attr = { .name = _name, .mode = 0444 },		\
+		.show = perf_event_sysfs_show,				\
+	},								\
+	.event_str = _str,						\
+}
+
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_energy, "energy", "event=0x01");
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_energy_unit, "energy.unit", "Joules");
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_energy_scale, "energy.scale", "1e-6");
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_current, "current", "event=0x02");
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_current_unit, "current.unit", "mA");
+MAX77818_PMU_EVENT_ATTR(max77818_pmu_current_scale, "current.scale", "1e-3");
+
+static struct attribute *max77818_fg_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static struct attribute *max77818_fg_pmu_event_attrs[] = {
+	&max77818_pmu_energy.attr.attr,
+	&max77818_pmu_energy_unit.attr.attr,
+	&max77818_pmu_energy_scale.attr.attr,
+	&max77818_pmu_current.attr.attr,
+	&max77818_pmu_current_unit.attr.attr,
+	&max77818_pmu_current_scale.attr.attr,
+	NULL,
+};
+
+static struct attribute *max77818_fg_pmu_cpumask_attrs[] = {
+	&max77818_fg_pmu_cpumask_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group max77818_fg_pmu_format_group = {
+	.name = "format",
+	.attrs = max77818_fg_pmu_format_attrs,
+};
+
+static const struct attribute_group max77818_fg_pmu_event_group = {
+	.name = "events",
+	.attrs = max77818_fg_pmu_event_attrs,
+};
+
+static const struct attribute_group max77818_fg_pmu_cpumask_group = {
+	.attrs = max77818_fg_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *max77818_fg_pmu_attr_groups[] = {
+	&max77818_fg_pmu_format_group,
+	&max77818_fg_pmu_event_group,
+	&max77818_fg_pmu_cpumask_group,
+	NULL,
+};
+
+static int max77818_fg_pmu_init(struct max77818_fg_dev *fg)
+{
+	const char *name;
+	int ret_val;
+
+	fg->pmu = (struct pmu) {
+		.module = THIS_MODULE,
+		.task_ctx_nr = perf_invalid_context,
+		.attr_groups = max77818_fg_pmu_attr_groups,
+		.event_init = max77818_fg_pmu_event_init,
+		.add = max77818_fg_pmu_add,
+		.del = max77818_fg_pmu_del,
+		.start = max77818_fg_pmu_start,
+		.stop = max77818_fg_pmu_stop,
+		.read = max77818_fg_pmu_read,
+	};
+
+	name = max77818_fg_instance_name(fg, "max77818", '_');
+	if (!name)
+		return -ENOMEM;
+
+	atomic_set(&fg->pmu_samplers, 0);
+	fg->pmu_cpu = cpumask_first(cpu_online_mask);
+
+	ret_val = cpuhp_state_add_instance_nocalls(max77818_fg_pmu_hp_state,
+						   &fg->pmu_node);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = perf_pmu_register(&fg->pmu, name, -1);
+	if (ret_val)
+		cpuhp_state_remove_instance_nocalls(max77818_fg_pmu_hp_state,
+						    &fg->pmu_node);
+
+	return ret_val;
+}
+
+static void max77818_fg_pmu_exit(struct max77818_fg_dev *fg)
+{
+	cpuhp_state_remove_instance_nocalls(max77818_fg_pmu_hp_state, &fg->pmu_node);
+	perf_pmu_unregister(&fg->pmu);
+}
+
+struct max77818_atrate_req {
+	struct list_head node;
+	struct max77818_atrate_query *q;
+	unsigned int count;
+	unsigned long pending;
+	int ret_val;
+	struct completion done;
+};
+
+/*
+ * xfer_lock is not held while the gauge settles, so the AtRate outputs
+ * are only taken if AtRate still holds the load written for them.
+ */
+static int max77818_fg_atrate_sample(struct max77818_fg_dev *fg, s32 load_ua, u16 *out)
+{
+	unsigned int val;
+	int data, i;
+	int ret_val;
+
+	/* Discharge is negative in AtRate, 156.25 uA/LSB with 10 mOhm sense */
+	load_ua = clamp_t(s32, load_ua, -5120000, 5120000);
+	data = clamp(-DIV_ROUND_CLOSEST(load_ua * 16, 2500), S16_MIN, S16_MAX);
+
+	for (i = 0; i < MAX77818_ATRATE_TRIES; i++) {
+		mutex_lock(&fg->xfer_lock);
+		ret_val = max77818_fg_write_custom_reg(fg, REG_AtRate, (u16)data);
+		mutex_unlock(&fg->xfer_lock);
+		if (ret_val)
+			return ret_val;
+
+		msleep(MAX77818_ATRATE_SETTLE_MS);
+
+		mutex_lock(&fg->xfer_lock);
+		ret_val = max77818_fg_read_custom_reg(fg, REG_AtRate, &val);
+		if (!ret_val && val == (u16)data)
+			ret_val = regmap_bulk_read(fg->regmap, REG_AtQresidual, out,
+						   REG_AtAvCap - REG_AtQresidual + 1);
+		else if (!ret_val)
+			ret_val = -EAGAIN;
+		mutex_unlock(&fg->xfer_lock);
+		if (ret_val != -EAGAIN)
+			return ret_val;
+
+		dev_dbg(fg->dev, "AtRate changed while settling, resampling\n");
+	}
+
+	return -EBUSY;
+}
+
+static bool max77818_fg_atrate_next(struct list_head *batch, s32 *load_ua)
+{
+	struct max77818_atrate_req *req;
+
+	list_for_each_entry(req, batch, node) {
+		if (req->pending) {
+			*load_ua = req->q[__ffs(req->pending)].load_ua;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Drain every queued AtRate request in one pass. Each distinct load is
+ * written to the single AtRate register once and its result is handed to
+ * all queries asking for that load, so concurrent callers share samples.
+ */
+static void max77818_fg_atrate_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(work, struct max77818_fg_dev,
+						  atrate_work);
+	u16 out[REG_AtAvCap - REG_AtQresidual + 1];
+	struct max77818_atrate_req *req, *tmp;
+	struct max77818_atrate_query *q;
+	LIST_HEAD(batch);
+	unsigned int i;
+	s32 load_ua;
+	int ret_val;
+
+	spin_lock(&fg->atrate_lock);
+	list_splice_init(&fg->atrate_queue, &batch);
+	spin_unlock(&fg->atrate_lock);
+
+	if (list_empty(&batch))
+		return;
+
+	while (max77818_fg_atrate_next(&batch, &load_ua)) {
+		ret_val = max77818_fg_atrate_sample(fg, load_ua, out);
+
+		list_for_each_entry(req, &batch, node) {
+			for_each_set_bit(i, &req->pending, req->count) {
+				q = &req->q[i];
+				if (q->load_ua != load_ua)
+					continue;
+
+				clear_bit(i, &req->pending);
+				if (ret_val) {
+					req->ret_val = ret_val;
+					continue;
+				}
+
+				q->qresidual_uah = out[REG_AtQresidual - REG_AtQresidual] * 500;
+				q->tte_s = max77818_fg_tte_to_sec(out[REG_AtTTE - REG_AtQresidual]);
+				q->av_soc = out[REG_AtAvSOC - REG_AtQresidual];
+				q->av_cap_uah = out[REG_AtAvCap - REG_AtQresidual] * 500;
+			}
+		}
+	}
+
+	mutex_lock(&fg->xfer_lock);
+	ret_val = max77818_fg_write_custom_reg(fg, REG_AtRate, fg->pdata->at_rate);
+	mutex_unlock(&fg->xfer_lock);
+	if (ret_val)
+		dev_warn(fg->dev, "fail to restore AtRate: %d\n", ret_val);
+
+	list_for_each_entry_safe(req, tmp, &batch, node) {
+		list_del(&req->node);
+		complete(&req->done);
+	}
+}
+
+/**
+ * max77818_fg_atrate_query - predict runtime for hypothetical loads
+ * @fg: fuelgauge device
+ * @q: queries, load_ua filled in by the caller, results filled in on return
+ * @count: number of queries, at most MAX77818_ATRATE_MAX
+ *
+ * Sleeps until the results are available. Returns 0 or a negative errno.
+ */
+int max77818_fg_atrate_query(struct max77818_fg_dev *fg,
+			     struct max77818_atrate_query *q, unsigned int count)
+{
+	struct max77818_atrate_req req;
+
+	if (!count || count > MAX77818_ATRATE_MAX)
+		return -EINVAL;
+
+	req.q = q;
+	req.count = count;
+	req.pending = GENMASK(count - 1, 0);
+	req.ret_val = 0;
+	init_completion(&req.done);
+
+	spin_lock(&fg->atrate_lock);
+	list_add_tail(&req.node, &fg->atrate_queue);
+	spin_unlock(&fg->atrate_lock);
+
+	/* Seconds of I2C traffic, kept out of suspend and off system_wq */
+	queue_work(system_freezable_wq, &fg->atrate_work);
+	wait_for_completion(&req.done);
+
+	return req.ret_val;
+}
+EXPORT_SYMBOL_GPL(max77818_fg_atrate_query);
+
+enum max77818_fg_iio_scan {
+	MAX77818_IIO_VCELL,
+	MAX77818_IIO_AVGVCELL,
+	MAX77818_IIO_CURRENT,
+	MAX77818_IIO_AVGCURRENT,
+	MAX77818_IIO_TEMP,
+	MAX77818_IIO_AIN0,
+	MAX77818_IIO_TIMESTAMP,
+};
+
+struct max77818_fg_iio {
+	struct max77818_fg_dev *fg;
+	struct {
+		u16 chans[MAX77818_IIO_TIMESTAMP];
+		s64 timestamp __aligned(8);
+	} scan;
+};
+
+#define MAX77818_IIO_CHAN(_type, _idx, _reg, _scan, _sign, _info) {	\
+	.type = _type,							\
+	.indexed = 1,							\
+	.channel = _idx,						\
+	.address = _reg,						\
+	.info_mask_separate = _info,					\
+	.scan_index = _scan,						\
+	.scan_type = {							\
+		.sign = _sign,						\
+		.realbits = 16,						\
+		.storagebits = 16,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+#define MAX77818_IIO_SCALED BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE)
+
+static const struct iio_chan_spec max77818_fg_iio_channels[] = {
+	MAX77818_IIO_CHAN(IIO_VOLTAGE, 0, REG_Vcell, MAX77818_IIO_VCELL,
+			  'u', MAX77818_IIO_SCALED),
+	MAX77818_IIO_CHAN(IIO_VOLTAGE, 1, REG_AvgVCell, MAX77818_IIO_AVGVCELL,
+			  'u', MAX77818_IIO_SCALED),
+	MAX77818_IIO_CHAN(IIO_CURRENT, 0, REG_Current, MAX77818_IIO_CURRENT,
+			  's', MAX77818_IIO_SCALED),
+	MAX77818_IIO_CHAN(IIO_CURRENT, 1, REG_AvgCurrent, MAX77818_IIO_AVGCURRENT,
+			  's', MAX77818_IIO_SCALED),
+	MAX77818_IIO_CHAN(IIO_TEMP, 0, REG_Temp, MAX77818_IIO_TEMP,
+			  's', MAX77818_IIO_SCALED),
+	/* Ratiometric input, no physical unit */
+	MAX77818_IIO_CHAN(IIO_VOLTAGE, 2, REG_AIN0, MAX77818_IIO_AIN0,
+			  'u', BIT(IIO_CHAN_INFO_RAW)),
+	IIO_CHAN_SOFT_TIMESTAMP(MAX77818_IIO_TIMESTAMP),
+};
+
+static int max77818_fg_iio_read_raw(struct iio_dev *indio_dev,
+				    struct iio_chan_spec const *chan,
+				    int *val, int *val2, long mask)
+{
+	struct max77818_fg_iio *priv = iio_priv(indio_dev);
+	unsigned int data;
+	int ret_val;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		ret_val = max77818_fg_read_custom_reg(priv->fg, chan->address, &data);
+		if (ret_val)
+			return ret_val;
+		if (chan->scan_type.sign == 's')
+			*val = sign_extend32(data, 15);
+		else
+			*val = data;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		switch (chan->type) {
+		case IIO_VOLTAGE:
+			/* 78.125 uV/LSB */
+			*val = 625;
+			*val2 = 8000;
+			return IIO_VAL_FRACTIONAL;
+		case IIO_CURRENT:
+			/* 1.5625 uV/LSB over 10 mOhm sense resistor */
+			*val = 0;
+			*val2 = 156250;
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_TEMP:
+			/* 1/256 C/LSB */
+			*val = 1000;
+			*val2 = 256;
+			return IIO_VAL_FRACTIONAL;
+		default:
+			return -EINVAL;
+		}
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info max77818_fg_iio_info = {
+	.read_raw = max77818_fg_iio_read_raw,
+};
+
+static irqreturn_t max77818_fg_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct max77818_fg_iio *priv = iio_priv(indio_dev);
+	struct max77818_fg_dev *fg = priv->fg;
+	u16 meas[REG_AvgCurrent - REG_Temp + 1];
+	unsigned int data;
+	int bit, i = 0;
+	int ret_val;
+
+	/* Temp, Vcell, Current and AvgCurrent are adjacent */
+	ret_val = regmap_bulk_read(fg->regmap, REG_Temp, meas, ARRAY_SIZE(meas));
+	if (ret_val)
+		goto done;
+
+	for_each_set_bit(bit, indio_dev->active_scan_mask, indio_dev->masklength) {
+		switch (bit) {
+		case MAX77818_IIO_VCELL:
+		case MAX77818_IIO_CURRENT:
+		case MAX77818_IIO_AVGCURRENT:
+		case MAX77818_IIO_TEMP:
+			priv->scan.chans[i++] =
+				meas[max77818_fg_iio_channels[bit].address - REG_Temp];
+			break;
+		case MAX77818_IIO_AVGVCELL:
+		case MAX77818_IIO_AIN0:
+			ret_val = max77818_fg_read_custom_reg(fg,
+					max77818_fg_iio_channels[bit].address, &data);
+			if (ret_val)
+				goto done;
+			priv->scan.chans[i++] = data;
+			break;
+		}
+	}
+
+	iio_push_to_buffers_with_timestamp(indio_dev, &priv->scan,
+					   iio_get_time_ns(indio_dev));
+done:
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static int max77818_fg_iio_init(struct max77818_fg_dev *fg)
+{
+	struct max77818_fg_iio *priv;
+	struct iio_dev *indio_dev;
+	int ret_val;
+
+	indio_dev = devm_iio_device_alloc(fg->dev, sizeof(*priv));
+	if (!indio_dev)
+		return -ENOMEM;
+
+	priv = iio_priv(indio_dev);
+	priv->fg = fg;
+
+	indio_dev->name = "max77818-fg";
+	indio_dev->dev.parent = fg->dev;
+	indio_dev->info = &max77818_fg_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = max77818_fg_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(max77818_fg_iio_channels);
+
+	ret_val = devm_iio_triggered_buffer_setup(fg->dev, indio_dev, NULL,
+						  max77818_fg_iio_trigger_handler,
+						  NULL);
+	if (ret_val)
+		return ret_val;
+
+	ret_val = devm_iio_device_register(fg->dev, indio_dev);
+	if (ret_val)
+		return ret_val;
+
+	fg->indio_dev = indio_dev;
+
+	return 0;
+}
+
+static const u16 max77818_fg_hwmon_alarm_bits[] = {
+	BIT_Vmn, BIT_Vmx, BIT_Tmn, BIT_Tmx,
+};
+
+static const char * const max77818_fg_hwmon_alarm_attrs[] = {
+	"in0_min_alarm", "in0_max_alarm", "temp1_min_alarm", "temp1_max_alarm",
+};
+
+/* Latch the threshold alerts from Status, called from the fuelgauge ISR */
+static void max77818_fg_hwmon_alarm(struct max77818_fg_dev *fg, unsigned int status)
+{
+	int i;
+
+	if (!fg->hwmon_dev)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(max77818_fg_hwmon_alarm_bits); i++) {
+		if (!(status & max77818_fg_hwmon_alarm_bits[i]))
+			continue;
+		set_bit(FFS(max77818_fg_hwmon_alarm_bits[i]), &fg->hwmon_alarms);
+		sysfs_notify(&fg->hwmon_dev->kobj, NULL,
+			     max77818_fg_hwmon_alarm_attrs[i]);
+	}
+}
+
+static int max77818_fg_hwmon_read_alarm(struct max77818_fg_dev *fg, u16 bit, long *val)
+{
+	*val = test_and_clear_bit(FFS(bit), &fg->hwmon_alarms);
+
+	return 0;
+}
+
+static int max77818_fg_hwmon_read_byte(struct max77818_fg_dev *fg, unsigned int reg,
+				       bool high, bool is_signed, long *val)
+{
+	unsigned int data;
+	int ret_val;
+
+	ret_val = max77818_fg_read_custom_reg(fg, reg, &data);
+	if (ret_val)
+		return ret_val;
+
+	data = high ? data >> 8 : data & 0xFF;
+	*val = is_signed ? (s8)data : data;
+
+	return 0;
+}
+
+static int max77818_fg_hwmon_read_in(struct max77818_fg_dev *fg, u32 attr, long *val)
+{
+	unsigned int data;
+	int ret_val;
+
+	switch (attr) {
+	case hwmon_in_input:
+		ret_val = max77818_fg_read_custom_reg(fg, REG_Vcell, &data);
+		if (ret_val)
+			return ret_val;
+		/* 78.125 uV/LSB */
+		*val = (data * 625) / 8000;
+		return 0;
+	case hwmon_in_lowest:
+	case hwmon_in_highest:
+		ret_val = max77818_fg_hwmon_read_byte(fg, REG_MaxMinVolt,
+				attr == hwmon_in_highest, false, val);
+		break;
+	case hwmon_in_min:
+	case hwmon_in_max:
+		ret_val = max77818_fg_hwmon_read_byte(fg, REG_VAlrtTh,
+				attr == hwmon_in_max, false, val);
+		break;
+	case hwmon_in_min_alarm:
+		return max77818_fg_hwmon_read_alarm(fg, BIT_Vmn, val);
+	case hwmon_in_max_alarm:
+		return max77818_fg_hwmon_read_alarm(fg, BIT_Vmx, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+	if (ret_val)
+		return ret_val;
+
+	/* 20 mV/LSB */
+	*val *= 20;
+
+	return 0;
+}
+
+static int max77818_fg_hwmon_read_curr(struct max77818_fg_dev *fg, u32 attr, long *val)
+{
+	unsigned int data;
+	int ret_val;
+
+	switch (attr) {
+	case hwmon_curr_input:
+		ret_val = max77818_fg_read_custom_reg(fg, REG_Current, &data);
+		if (ret_val)
+			return ret_val;
+		/* 1.5625 uV/LSB over 10 mOhm sense resistor */
+		*val = ((s16)data * 15625) / 100000;
+		return 0;
+	case hwmon_curr_lowest:
+	case hwmon_curr_highest:
+		ret_val = max77818_fg_hwmon_read_byte(fg, REG_MaxMinCurr,
+				attr == hwmon_curr_highest, true, val);
+		if (ret_val)
+			return ret_val;
+		/* 0.4 mV/LSB over 10 mOhm sense resistor */
+		*val *= 40;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int max77818_fg_hwmon_read_temp(struct max77818_fg_dev *fg, u32 attr, long *val)
+{
+	unsigned int data;
+	int ret_val;
+
+	switch (attr) {
+	case hwmon_temp_input:
+		ret_val = max77818_fg_read_custom_reg(fg, REG_Temp, &data);
+		if (ret_val)
+			return ret_val;
+		/* 1/256 C/LSB */
+		*val = ((s16)data * 1000) / 256;
+		return 0;
+	case hwmon_temp_lowest:
+	case hwmon_temp_highest:
+		ret_val = max77818_fg_hwmon_read_byte(fg, REG_MaxMinTemp,
+				attr == hwmon_temp_highest, true, val);
+		break;
+	case hwmon_temp_min:
+	case hwmon_temp_max:
+		ret_val = max77818_fg_hwmon_read_byte(fg, REG_TAlrtTh,
+				attr == hwmon_temp_max, true, val);
+		break;
+	case hwmon_temp_min_alarm:
+		return max77818_fg_hwmon_read_alarm(fg, BIT_Tmn, val);
+	case hwmon_temp_max_alarm:
+		return max77818_fg_hwmon_read_alarm(fg, BIT_Tmx, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+	if (ret_val)
+		return ret_val;
+
+	/* 1 C/LSB */
+	*val *= 1000;
+
+	return 0;
+}
+
+static int max77818_fg_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+				  u32 attr, int channel, long *val)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_in:
+		return max77818_fg_hwmon_read_in(fg, attr, val);
+	case hwmon_curr:
+		return max77818_fg_hwmon_read_curr(fg, attr, val);
+	case hwmon_temp:
+		return max77818_fg_hwmon_read_temp(fg, attr, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int max77818_fg_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+				   u32 attr, int channel, long val)
+{
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+	unsigned int mask, shift;
+
+	if (type != hwmon_in)
+		return -EOPNOTSUPP;
+
+	switch (attr) {
+	case hwmon_in_min:
+		mask = BIT_MinVoltageAlrt;
+		break;
+	case hwmon_in_max:
+		mask = BIT_MaxVoltageAlrt;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	shift = FFS(mask);
+	val = DIV_ROUND_CLOSEST(clamp_val(val, 0, 0xFF * 20), 20);
+
+	return regmap_update_bits(fg->regmap, REG_VAlrtTh, mask, val << shift);
+}
+
+static umode_t max77818_fg_hwmon_is_visible(const void *data,
+					    enum hwmon_sensor_types type,
+					    u32 attr, int channel)
+{
+	/* Temperature thresholds belong to the thermal state machine */
+	if (type == hwmon_in && (attr == hwmon_in_min || attr == hwmon_in_max))
+		return 0644;
+
+	return 0444;
+}
+
+static const struct hwmon_channel_info *max77818_fg_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(in,
+			   HWMON_I_INPUT | HWMON_I_LOWEST | HWMON_I_HIGHEST |
+			   HWMON_I_MIN | HWMON_I_MAX |
+			   HWMON_I_MIN_ALARM | HWMON_I_MAX_ALARM),
+	HWMON_CHANNEL_INFO(curr,
+			   HWMON_C_INPUT | HWMON_C_LOWEST | HWMON_C_HIGHEST),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LOWEST | HWMON_T_HIGHEST |
+			   HWMON_T_MIN | HWMON_T_MAX |
+			   HWMON_T_MIN_ALARM | HWMON_T_MAX_ALARM),
+	NULL
+};
+
+static const struct hwmon_ops max77818_fg_hwmon_ops = {
+	.is_visible = max77818_fg_hwmon_is_visible,
+	.read = max77818_fg_hwmon_read,
+	.write = max77818_fg_hwmon_write,
+};
+
+static const struct hwmon_chip_info max77818_fg_hwmon_chip_info = {
+	.ops = &max77818_fg_hwmon_ops,
+	.info = max77818_fg_hwmon_info,
+};
+
+static int max77818_fg_hwmon_init(struct max77818_fg_dev *fg)
+{
+	struct device *hwmon_dev;
+
+	hwmon_dev = devm_hwmon_device_register_with_info(fg->dev, "max77818", fg,
+							 &max77818_fg_hwmon_chip_info,
+							 NULL);
+	if (IS_ERR(hwmon_dev))
+		return PTR_ERR(hwmon_dev);
+
+	fg->hwmon_dev = hwmon_dev;
+
+	return 0;
+}
+
+static ssize_t learned_params_read(struct file *filp, struct kobject *kobj,
+				   struct bin_attribute *attr, char *buf,
+				   loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+	struct max77818_fg_learned_params learned;
+	struct max77818_fg_learned_blob blob;
+	int ret_val;
+
+	if (off >= sizeof(blob))
+		return 0;
+	if (count > sizeof(blob) - off)
+		count = sizeof(blob) - off;
+
+	mutex_lock(&fg->xfer_lock);
+	ret_val = max77818_fg_read_learned_params(fg, &learned);
+	if (!ret_val)
+		*fg->learned = learned;
+	mutex_unlock(&fg->xfer_lock);
+	if (ret_val)
+		return ret_val;
+
+	max77818_fg_learned_to_blob(&learned, &blob);
+	memcpy(buf, (u8 *)&blob + off, count);
+
+	return count;
+}
+
+static ssize_t learned_params_write(struct file *filp, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct max77818_fg_dev *fg = dev_get_drvdata(dev);
+	struct max77818_fg_learned_params learned;
+	int ret_val;
+
+	/* Only whole images are accepted, partial writes would tear the set */
+	if (off != 0 || count != sizeof(struct max77818_fg_learned_blob))
+		return -EINVAL;
+
+	ret_val = max77818_fg_blob_to_learned((struct max77818_fg_learned_blob *)buf,
+					      &learned);
+	if (ret_val) {
+		dev_err(fg->dev, "learned params image rejected: %d\n", ret_val);
+		return ret_val;
+	}
+
+	mutex_lock(&fg->xfer_lock);
+	*fg->learned = learned;
+	ret_val = max77818_fg_restore_learned_params(fg);
+	mutex_unlock(&fg->xfer_lock);
+	if (ret_val)
+		return ret_val;
+
+	return count;
+}
+
+static BIN_ATTR_RW(learned_params, sizeof(struct max77818_fg_learned_blob));
+
+static DEVICE_ATTR_RW(learned_rcomp0);
+static DEVICE_ATTR_RW(learned_temp_co);
+static DEVICE_ATTR_RW(learned_full_cap_rep);
+static DEVICE_ATTR_RW(learned_cycles);
 static DEVICE_ATTR_RW(learned_full_cap_nom);
 static DEVICE_ATTR_RW(learned_qresidual00);
 static DEVICE_ATTR_RW(learned_qresidual10);
@@ -1118,235 +3212,518 @@ static DEVICE_ATTR_RW(learned_cv_mixcap);
 static DEVICE_ATTR_RW(learned_cv_halftime);
 static DEVICE_ATTR_WO(load_params);
 static DEVICE_ATTR_RO(ain0);
-static DEVICE_ATTR_RO(self_test);
+static DEVICE_ATTR_RW(self_test);
+static DEVICE_ATTR_RO(self_test_result);
+static DEVICE_ATTR_RO(self_test_timestamp);
+static DEVICE_ATTR_RW(telemetry_rate);
+static DEVICE_ATTR_RO(energy_charged);
+static DEVICE_ATTR_RO(energy_discharged);
+static DEVICE_ATTR_RO(power_budget);
+
+/* Called when the charger, which lists us in supplied_to, changes */
+static void max77818_fg_external_power_changed(struct power_supply *psy)
+{
+	struct max77818_fg_dev *fg = power_supply_get_drvdata(psy);
+	union power_supply_propval val;
+	struct power_supply *charger;
+
+	charger = power_supply_get_by_name(fg->charger_name);
+	if (!charger)
+		return;
+
+	if (!power_supply_get_property(charger, POWER_SUPPLY_PROP_STATUS, &val))
+		WRITE_ONCE(fg->chg_status, val.intval);
+	power_supply_put(charger);
+
+	power_supply_changed(psy);
+}
+
+static const struct power_supply_desc max77818_fg_desc = {
+	.name = "max77818-fg",
+	.type = POWER_SUPPLY_TYPE_BATTERY,
+	.properties = max77818_fg_props,
+	.num_properties = ARRAY_SIZE(max77818_fg_props),
+	.get_property = max77818_fg_get_property,
+	.set_property = max77818_fg_set_property,
+	.property_is_writeable = max77818_fg_property_is_writable,
+	.external_power_changed = max77818_fg_external_power_changed,
+};
+
+struct max77818_fg_init_reg {
+	unsigned int reg;
+	size_t offset;
+	unsigned int val;
+	unsigned int flags;
+};
+
+#define MAX77818_FG_INIT_VERIFY    BIT(0)  /* Read back in the verify pass */
+#define MAX77818_FG_INIT_OPTIONAL  BIT(1)  /* Skipped when platform value is 0 */
+#define MAX77818_FG_INIT_CONST     BIT(2)  /* Write .val instead of platform value */
+#define MAX77818_FG_INIT_RUNTIME   BIT(3)  /* Sampled at init, not part of the fingerprint */
+#define MAX77818_FG_INIT_MODEL     BIT(4)  /* Model or learned state, only written with the model */
+
+#define MAX77818_FG_INIT_PDATA(_reg, _field, _flags) \
+	{ .reg = _reg, .flags = _flags, \
+	  .offset = offsetof(struct max77818_fg_platform_data, _field) }
+
+#define MAX77818_FG_INIT_VAL(_reg, _val) \
+	{ .reg = _reg, .val = _val, .flags = MAX77818_FG_INIT_CONST }
+
+#define MAX77818_FG_INIT_MODEL_VAL(_reg, _val) \
+	{ .reg = _reg, .val = _val, \
+	  .flags = MAX77818_FG_INIT_CONST | MAX77818_FG_INIT_MODEL }
+
+/*
+ * ModelGauge m5 custom model configuration, written in this order after
+ * the OCV table has been loaded and before LdMdl is set. A config refresh
+ * writes only the entries not flagged MODEL, so what the gauge has learned
+ * since the model was loaded is left alone.
+ */
+static const struct max77818_fg_init_reg max77818_fg_init_regs[] = {
+	MAX77818_FG_INIT_MODEL_VAL(REG_RepCap, 0x0000),
+	MAX77818_FG_INIT_MODEL_VAL(REG_VFSOC0Enable, MAX77818_VFSOC0_UNLOCK),
+	MAX77818_FG_INIT_PDATA(REG_VFSOC0, vfsoc0, MAX77818_FG_INIT_VERIFY |
+			       MAX77818_FG_INIT_RUNTIME | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_MODEL_VAL(REG_VFSOC0Enable, MAX77818_VFSOC0_LOCK),
+	MAX77818_FG_INIT_PDATA(REG_DesignCap, design_cap, 0),
+	MAX77818_FG_INIT_PDATA(REG_Config, config, 0),
+	MAX77818_FG_INIT_PDATA(REG_Config2, config2, 0),
+	MAX77818_FG_INIT_PDATA(REG_dQacc, dqacc,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_dPacc, dpacc,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_FilterCfg, filter_cfg, 0),
+	MAX77818_FG_INIT_PDATA(REG_FullCapNom, full_cap_nom,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_FullCapRep, full_cap_rep,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_FullSocThr, full_soc_thr, 0),
+	MAX77818_FG_INIT_PDATA(REG_IavgEmpty, iavg_empty, 0),
+	MAX77818_FG_INIT_PDATA(REG_IchgTerm, i_chg_term, 0),
+	MAX77818_FG_INIT_PDATA(REG_LearnCfg, learn_cfg, 0),
+	MAX77818_FG_INIT_PDATA(REG_QRTable00, qresidual00,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_QRTable10, qresidual10,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_QRTable20, qresidual20,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_QRTable30, qresidual30,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_RComp0, rcomp0,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_RelaxCfg, relax_cfg, 0),
+	MAX77818_FG_INIT_PDATA(REG_TempCo, temp_co,
+			       MAX77818_FG_INIT_VERIFY | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_V_empty, v_empty, 0),
+	MAX77818_FG_INIT_PDATA(REG_TGain, tgain, 0),
+	MAX77818_FG_INIT_PDATA(REG_TOff, toff, 0),
+	MAX77818_FG_INIT_PDATA(REG_Curve, curve, 0),
+	/* Restart max and min temperature counters */
+	MAX77818_FG_INIT_MODEL_VAL(REG_MaxMinTemp, 0x007F),
+	MAX77818_FG_INIT_PDATA(REG_AtRate, at_rate, 0),
+	MAX77818_FG_INIT_PDATA(REG_CV_MixCap, cv_mixcap, MAX77818_FG_INIT_VERIFY |
+			       MAX77818_FG_INIT_OPTIONAL | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_CV_HalfTime, cv_halftime, MAX77818_FG_INIT_VERIFY |
+			       MAX77818_FG_INIT_OPTIONAL | MAX77818_FG_INIT_MODEL),
+	MAX77818_FG_INIT_PDATA(REG_SmartChgCfg, smartchgcfg, 0),
+	MAX77818_FG_INIT_PDATA(REG_ConvgCfg, convg_cfg, 0),
+};
+
+static unsigned int max77818_fg_init_reg_val(struct max77818_fg_platform_data *pdata,
+					     const struct max77818_fg_init_reg *ir)
+{
+	if (ir->flags & MAX77818_FG_INIT_CONST)
+		return ir->val;
+
+	return *(unsigned int *)((u8 *)pdata + ir->offset);
+}
+
+/*
+ * Commit the configuration table in one regmap transaction, then read
+ * back the registers flagged for verification. Registers that did not
+ * stick are written once more, as recommended by Maxim. Entries with any
+ * of the skip flags are left out.
+ */
+static int max77818_fg_write_config(struct max77818_fg_dev *fg,
+				    unsigned int skip)
+{
+	struct max77818_fg_platform_data *pdata = fg->pdata;
+	const struct max77818_fg_init_reg *ir;
+	struct reg_sequence *seq;
+	unsigned int val, data;
+	int i, n = 0;
+	int ret_val;
+
+	seq = kmalloc_array(ARRAY_SIZE(max77818_fg_init_regs), sizeof(*seq),
+			    GFP_KERNEL);
+	if (!seq)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(max77818_fg_init_regs); i++) {
+		ir = &max77818_fg_init_regs[i];
+		if (ir->flags & skip)
+			continue;
+		val = max77818_fg_init_reg_val(pdata, ir);
+		if ((ir->flags & MAX77818_FG_INIT_OPTIONAL) && !val)
+			continue;
+		seq[n].reg = ir->reg;
+		seq[n].def = val;
+		seq[n].delay_us = 0;
+		n++;
+	}
+
+	ret_val = regmap_multi_reg_write(fg->regmap, seq, n);
+	kfree(seq);
+	if (ret_val) {
+		dev_err(fg->dev, "config table write failed: %d\n", ret_val);
+		return ret_val;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(max77818_fg_init_regs); i++) {
+		ir = &max77818_fg_init_regs[i];
+		if (!(ir->flags & MAX77818_FG_INIT_VERIFY) || ir->flags & skip)
+			continue;
+		val = max77818_fg_init_reg_val(pdata, ir);
+		if ((ir->flags & MAX77818_FG_INIT_OPTIONAL) && !val)
+			continue;
+
+		ret_val = max77818_fg_read_custom_reg(fg, ir->reg, &data);
+		if (ret_val)
+			return ret_val;
+		if (data == val)
+			continue;
+
+		ret_val = max77818_fg_write_verify_custom_reg(fg, ir->reg, val);
+		if (ret_val)
+			return ret_val;
+	}
+
+	return 0;
+}
 
-static struct power_supply_config max77818_fg_config = {
+/*
+ * Fingerprints of the model (OCV table and MODEL entries) and of the rest
+ * of the configuration table, stored in two scratch registers so a warm
+ * probe can tell in one read whether the model in the gauge is the one
+ * described by the platform data.
+ */
+static void max77818_fg_fingerprint(struct max77818_fg_dev *fg, u16 *fp)
+{
+	struct max77818_fg_platform_data *pdata = fg->pdata;
+	const struct max77818_fg_init_reg *ir;
+	__le16 val;
+	u16 *crc;
+	int i;
 
-};
+	fp[0] = 0;
+	for (i = 0; i < MAX77818_OCV_LENGTH; i++) {
+		val = cpu_to_le16(pdata->battery_ocv_model[i]);
+		fp[0] = crc16(fp[0], (u8 *)&val, sizeof(val));
+	}
 
-static const struct power_supply_desc max77818_fg_desc = {
-	.name = "max77818-fg",
-	.type = POWER_SUPPLY_TYPE_BATTERY,
-	.properties = max77818_fg_props,
-	.num_properties = ARRAY_SIZE(max77818_fg_props),
-	.get_property = max77818_fg_get_property,
-	.set_property = max77818_fg_set_property,
-	.property_is_writeable = max77818_fg_property_is_writable,
-};
+	fp[1] = 0;
+	for (i = 0; i < ARRAY_SIZE(max77818_fg_init_regs); i++) {
+		ir = &max77818_fg_init_regs[i];
+		if (ir->flags & MAX77818_FG_INIT_RUNTIME)
+			continue;
+		crc = ir->flags & MAX77818_FG_INIT_MODEL ? &fp[0] : &fp[1];
+		val = cpu_to_le16(ir->reg);
+		*crc = crc16(*crc, (u8 *)&val, sizeof(val));
+		val = cpu_to_le16(max77818_fg_init_reg_val(pdata, ir));
+		*crc = crc16(*crc, (u8 *)&val, sizeof(val));
+	}
+}
 
-static int max77818_fg_reg_init(struct max77818_fg_dev *fg)
+static int max77818_fg_init_action(struct max77818_fg_dev *fg,
+				   unsigned int status)
 {
-	struct max77818_fg_platform_data *pdata = fg->pdata;
-	unsigned int data;
+	u16 fp[2], stored[2];
 	int ret_val;
 
-	/* Check for Status POR bit */
-	ret_val = max77818_fg_read_custom_reg(fg, REG_Status,
-					      &data);
-	if (ret_val < 0) {
+	if (status & BIT_POR)
+		return MAX77818_INIT_FULL;
+
+	if (!fg->pdata->fingerprint_reg)
+		return MAX77818_INIT_SKIP;
+
+	ret_val = regmap_bulk_read(fg->regmap, fg->pdata->fingerprint_reg,
+				   stored, ARRAY_SIZE(stored));
+	if (ret_val)
 		return ret_val;
+
+	max77818_fg_fingerprint(fg, fp);
+
+	if (stored[0] != fp[0]) {
+		dev_info(fg->dev, "model fingerprint mismatch, reloading model\n");
+		return MAX77818_INIT_FULL;
 	}
-	if ((data & BIT_POR) == 0) {
-		dev_info(fg->dev, "Fuelgauge already set up\n");
-		return 0;
+	if (stored[1] != fp[1]) {
+		dev_info(fg->dev, "config fingerprint mismatch, refreshing config\n");
+		return MAX77818_INIT_CONFIG;
 	}
 
-	/* Load battery model */
-	ret_val = max77818_fg_write_model(fg);
-	if (ret_val) {
-		return ret_val;
-	}
+	return MAX77818_INIT_SKIP;
+}
 
-	/* Write custom register values */
-	ret_val=max77818_fg_write_custom_reg(fg, REG_RepCap, 0x0000);
-	if (ret_val) {
-		return ret_val;
-	}
+/* Wait until the gauge has finished its power-up measurements */
+static int max77818_fg_wait_dnr(struct max77818_fg_dev *fg)
+{
+	unsigned int data;
+	int ret_val;
 
-	ret_val = max77818_fg_read_custom_reg(fg, REG_VFSOC,
-					      &pdata->vfsoc0);
+	ret_val = regmap_read_poll_timeout(fg->regmap, REG_FStat, data,
+					   !(data & BIT_DNR), 10000,
+					   MAX77818_DNR_TIMEOUT_US);
 	if (ret_val)
-		return ret_val;
+		dev_err(fg->dev, "fuelgauge data not ready\n");
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_VFSOC0,
-						      pdata->vfsoc0);
-	if (ret_val)
-		return ret_val;
+	return ret_val;
+}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_DesignCap,
-					       pdata->design_cap);
-	if (ret_val)
-		return ret_val;
+static int max77818_fg_reg_init(struct max77818_fg_dev *fg)
+{
+	struct max77818_fg_platform_data *pdata = fg->pdata;
+	unsigned int status, hibcfg;
+	u16 fp[2];
+	int action;
+	int ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_Config,
-					       pdata->config);
-	if (ret_val)
+	/* Check for Status POR bit */
+	ret_val = max77818_fg_read_custom_reg(fg, REG_Status,
+					      &status);
+	if (ret_val < 0) {
 		return ret_val;
+	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_Config2,
-					       pdata->config2);
-	if (ret_val)
-		return ret_val;
+	action = max77818_fg_init_action(fg, status);
+	if (action < 0)
+		return action;
+	if (action == MAX77818_INIT_SKIP) {
+		dev_info(fg->dev, "Fuelgauge already set up\n");
+		return 0;
+	}
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_dQacc,
-						      pdata->dqacc);
+	ret_val = max77818_fg_wait_dnr(fg);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_dPacc,
-						      pdata->dpacc);
+	/* Keep the gauge out of hibernate while the model is loaded */
+	ret_val = max77818_fg_read_custom_reg(fg, REG_HibCFG, &hibcfg);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_FilterCfg,
-					       pdata->filter_cfg);
+	ret_val = max77818_fg_write_custom_reg(fg, REG_Command,
+					       MAX77818_CMD_SOFT_WAKEUP);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_FullCapNom,
-						      pdata->full_cap_nom);
+	ret_val = max77818_fg_write_custom_reg(fg, REG_HibCFG, 0x0000);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_FullCapRep,
-						      pdata->full_cap_rep);
+	ret_val = max77818_fg_write_custom_reg(fg, REG_Command,
+					       MAX77818_CMD_CLEAR);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_FullSocThr,
-					       pdata->full_soc_thr);
-	if (ret_val)
-		return ret_val;
+	if (action == MAX77818_INIT_CONFIG) {
+		/* Learned state and RepCap stay, no LdMdl to pick them up */
+		ret_val = max77818_fg_write_config(fg, MAX77818_FG_INIT_MODEL);
+		if (ret_val)
+			return ret_val;
+	} else {
+		/* Load battery model */
+		ret_val = max77818_fg_write_model(fg);
+		if (ret_val) {
+			return ret_val;
+		}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_IavgEmpty,
-					       pdata->iavg_empty);
-	if (ret_val)
-		return ret_val;
+		ret_val = max77818_fg_read_custom_reg(fg, REG_VFSOC,
+						      &pdata->vfsoc0);
+		if (ret_val)
+			return ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_IchgTerm,
-					       pdata->i_chg_term);
-	if (ret_val)
-		return ret_val;
+		/* Write custom register values */
+		ret_val = max77818_fg_write_config(fg, 0);
+		if (ret_val)
+			return ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_LearnCfg,
-					       pdata->learn_cfg);
-	if (ret_val)
-		return ret_val;
+		/* Load model */
+		ret_val = max77818_fg_load_model(fg);
+		if (ret_val) {
+			return ret_val;
+		}
+	}
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_QRTable00,
-						      pdata->qresidual00);
+	ret_val = max77818_fg_write_custom_reg(fg, REG_HibCFG, hibcfg);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_QRTable10,
-						      pdata->qresidual10);
-	if (ret_val)
-		return ret_val;
+	if (pdata->fingerprint_reg) {
+		max77818_fg_fingerprint(fg, fp);
+		ret_val = regmap_bulk_write(fg->regmap, pdata->fingerprint_reg,
+					    fp, ARRAY_SIZE(fp));
+		if (ret_val)
+			return ret_val;
+	}
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_QRTable20,
-						      pdata->qresidual20);
-	if (ret_val)
-		return ret_val;
+	if (!(status & BIT_POR))
+		return 0;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_QRTable30,
-						      pdata->qresidual30);
+	/* Model is in place, a POR seen from now on is a new one */
+	ret_val = regmap_update_bits(fg->regmap, REG_Status, BIT_POR, 0);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_RComp0,
-						      pdata->rcomp0);
+	/* Learned params were lost with POR, bring back the last checkpoint */
+	ret_val = max77818_fg_restore_checkpoint(fg);
 	if (ret_val)
-		return ret_val;
+		dev_warn(fg->dev, "learned params restore failed: %d\n", ret_val);
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_RelaxCfg,
-					       pdata->relax_cfg);
-	if (ret_val)
-		return ret_val;
+	return 0;
+}
 
-	ret_val = max77818_fg_write_verify_custom_reg(fg, REG_TempCo,
-						      pdata->temp_co);
-	if (ret_val)
-		return ret_val;
+static int max77818_fg_select_profile(struct max77818_fg_dev *fg,
+				      struct device_node *np, const char **name)
+{
+	u32 windows[MAX77818_PROFILE_MAX * 2];
+	unsigned int ain0;
+	int count, i;
+	int ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_V_empty,
-					       pdata->v_empty);
-	if (ret_val)
-		return ret_val;
+	count = of_property_count_strings(np, "battery_profiles");
+	if (count <= 0)
+		return -ENOENT;
+	if (count > MAX77818_PROFILE_MAX) {
+		dev_warn(fg->dev, "only %d battery profiles supported\n",
+			 MAX77818_PROFILE_MAX);
+		count = MAX77818_PROFILE_MAX;
+	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_TGain,
-					       pdata->tgain);
-	if (ret_val)
-		return ret_val;
+	/* One [min, max] AIN0 window per profile */
+	if (of_property_read_u32_array(np, "battery_profile_ain0", windows,
+				       count * 2)) {
+		dev_err(fg->dev, "Property battery_profile_ain0 not found.\n");
+		return -EINVAL;
+	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_TOff,
-					       pdata->toff);
+	/* AIN0 is only measured once the gauge is out of its POR sequence */
+	ret_val = max77818_fg_wait_dnr(fg);
 	if (ret_val)
 		return ret_val;
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_Curve,
-					       pdata->curve);
+	ret_val = max77818_fg_read_custom_reg(fg, REG_AIN0, &ain0);
 	if (ret_val)
 		return ret_val;
 
-	//Restart max and min temperature counters
-	ret_val = max77818_fg_write_custom_reg(fg, REG_MaxMinTemp,
-				       0x007F);
-	if (ret_val) {
-		return ret_val;
+	for (i = 0; i < count; i++) {
+		if (ain0 >= windows[2 * i] && ain0 <= windows[2 * i + 1]) {
+			dev_dbg(fg->dev, "AIN0 0x%04x selects profile %d\n",
+				ain0, i);
+			return of_property_read_string_index(np, "battery_profiles",
+							     i, name);
+		}
 	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_VFSOC0Enable,
-					       0x0080);
-	if (ret_val) {
-		return ret_val;
-	}
+	dev_warn(fg->dev, "no battery profile matches AIN0 0x%04x\n", ain0);
+	return -ENOENT;
+}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_AtRate,
-					       pdata->at_rate);
-	if (ret_val) {
-		return ret_val;
-	}
+#define MAX77818_PROFILE_FG(_pdata, _prof, _field) \
+	((_pdata)->_field = le16_to_cpu((_prof)->_field))
 
-	if (pdata->cv_mixcap) {
-		ret_val = max77818_fg_write_verify_custom_reg(fg,
-							      REG_CV_MixCap,
-							      pdata->cv_mixcap);
-		if (ret_val) {
-			return ret_val;
-		}
-		ret_val = max77818_fg_write_verify_custom_reg(fg,
-							      REG_CV_HalfTime,
-							      pdata->cv_halftime);
-		if (ret_val) {
-			return ret_val;
-		}
-	}
+#define MAX77818_PROFILE_CHG(_limits, _prof, _field) \
+	((_limits)->_field = le32_to_cpu((_prof)->_field))
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_SmartChgCfg,
-					       pdata->smartchgcfg);
-	if (ret_val) {
+static int max77818_fg_load_profile(struct max77818_fg_dev *fg,
+				    struct device_node *np)
+{
+	struct max77818_fg_platform_data *pdata = fg->pdata;
+	struct max77818_battery_limits limits = { };
+	const struct max77818_battery_profile *prof;
+	const struct firmware *fw;
+	const char *name;
+	u32 crc;
+	int i;
+	int ret_val;
+
+	ret_val = max77818_fg_select_profile(fg, np, &name);
+	if (ret_val)
 		return ret_val;
-	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_ConvgCfg,
-					       pdata->convg_cfg);
+	/* -ENOENT is kept for "no profile configured" */
+	ret_val = request_firmware(&fw, name, fg->dev);
 	if (ret_val) {
-		return ret_val;
+		dev_err(fg->dev, "battery profile %s: request failed: %d\n",
+			name, ret_val);
+		return -ENODATA;
 	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_VFSOC0Enable,
-					       0x0000);
-	if (ret_val) {
-		return ret_val;
+	prof = (const struct max77818_battery_profile *)fw->data;
+	if (fw->size != sizeof(*prof) ||
+	    le32_to_cpu(prof->magic) != MAX77818_PROFILE_MAGIC ||
+	    le16_to_cpu(prof->version) != MAX77818_PROFILE_VERSION ||
+	    le16_to_cpu(prof->size) != sizeof(*prof)) {
+		dev_err(fg->dev, "battery profile %s: bad header\n", name);
+		ret_val = -EINVAL;
+		goto out;
 	}
 
-	/* Load model */
-	ret_val = max77818_fg_load_model(fg);
-	if (ret_val) {
-		return ret_val;
+	crc = ~crc32_le(~0, fw->data, offsetof(struct max77818_battery_profile, crc));
+	if (crc != le32_to_cpu(prof->crc)) {
+		dev_err(fg->dev, "battery profile %s: bad crc\n", name);
+		ret_val = -EBADMSG;
+		goto out;
 	}
 
-	return 0;
+	for (i = 0; i < MAX77818_OCV_LENGTH; i++)
+		pdata->battery_ocv_model[i] = le16_to_cpu(prof->ocv[i]);
+
+	MAX77818_PROFILE_FG(pdata, prof, design_cap);
+	MAX77818_PROFILE_FG(pdata, prof, config);
+	MAX77818_PROFILE_FG(pdata, prof, config2);
+	MAX77818_PROFILE_FG(pdata, prof, dqacc);
+	MAX77818_PROFILE_FG(pdata, prof, dpacc);
+	MAX77818_PROFILE_FG(pdata, prof, filter_cfg);
+	MAX77818_PROFILE_FG(pdata, prof, full_cap_nom);
+	MAX77818_PROFILE_FG(pdata, prof, full_cap_rep);
+	MAX77818_PROFILE_FG(pdata, prof, full_soc_thr);
+	MAX77818_PROFILE_FG(pdata, prof, iavg_empty);
+	MAX77818_PROFILE_FG(pdata, prof, i_chg_term);
+	MAX77818_PROFILE_FG(pdata, prof, learn_cfg);
+	MAX77818_PROFILE_FG(pdata, prof, qresidual00);
+	MAX77818_PROFILE_FG(pdata, prof, qresidual10);
+	MAX77818_PROFILE_FG(pdata, prof, qresidual20);
+	MAX77818_PROFILE_FG(pdata, prof, qresidual30);
+	MAX77818_PROFILE_FG(pdata, prof, rcomp0);
+	MAX77818_PROFILE_FG(pdata, prof, relax_cfg);
+	MAX77818_PROFILE_FG(pdata, prof, temp_co);
+	MAX77818_PROFILE_FG(pdata, prof, v_empty);
+	MAX77818_PROFILE_FG(pdata, prof, tgain);
+	MAX77818_PROFILE_FG(pdata, prof, toff);
+	MAX77818_PROFILE_FG(pdata, prof, curve);
+	MAX77818_PROFILE_FG(pdata, prof, at_rate);
+	MAX77818_PROFILE_FG(pdata, prof, cv_mixcap);
+	MAX77818_PROFILE_FG(pdata, prof, cv_halftime);
+	MAX77818_PROFILE_FG(pdata, prof, smartchgcfg);
+	MAX77818_PROFILE_FG(pdata, prof, convg_cfg);
+	MAX77818_PROFILE_FG(pdata, prof, talrt_low);
+	MAX77818_PROFILE_FG(pdata, prof, talrt_norm);
+	MAX77818_PROFILE_FG(pdata, prof, talrt_high);
+
+	/* Pushed to the charger, now or when it binds */
+	MAX77818_PROFILE_CHG(&limits, prof, fast_charge_timer_timeout);
+	MAX77818_PROFILE_CHG(&limits, prof, charge_current_limit);
+	MAX77818_PROFILE_CHG(&limits, prof, topoff_current_threshold);
+	MAX77818_PROFILE_CHG(&limits, prof, topoff_timer_timeout);
+	MAX77818_PROFILE_CHG(&limits, prof, prim_charge_term_voltage);
+	MAX77818_PROFILE_CHG(&limits, prof, battery_overcurrent_threshold);
+	max77818_set_battery_limits(fg->max77818, &limits);
+
+	dev_info(fg->dev, "battery profile %s loaded\n", name);
+out:
+	release_firmware(fw);
+	return ret_val;
 }
 
 static int max77818_fg_parse_dt(struct max77818_fg_dev *fg)
@@ -1354,18 +3731,46 @@ static int max77818_fg_parse_dt(struct max77818_fg_dev *fg)
 	struct max77818_fg_platform_data *pdata = fg->pdata;
 	struct device_node *np = of_find_node_by_name(fg->dev->parent->of_node, "fuelgauge");
 	unsigned int *ocv_model;
+	int ret_val;
+
+	fg->learned_cell = devm_nvmem_cell_get(fg->dev, "learned-params");
+	if (IS_ERR(fg->learned_cell)) {
+		if (PTR_ERR(fg->learned_cell) == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		dev_warn(fg->dev, "learned-params nvmem cell not found (Optional)\n");
+		fg->learned_cell = NULL;
+	}
+
+	if (of_property_read_u32(np, "fingerprint_reg", &pdata->fingerprint_reg)) {
+		dev_warn(fg-> dev, "Property fingerprint_reg not found (Optional).\n");
+		pdata->fingerprint_reg = 0;
+	}
+
+	if (of_property_read_u32(np, "nominal_voltage", &pdata->nominal_voltage)) {
+		dev_warn(fg-> dev, "Property nominal_voltage not found (Optional).\n");
+		pdata->nominal_voltage = MAX77818_NOMINAL_VOLTAGE_DEF;
+	}
 
 	ocv_model = kzalloc(sizeof(ocv_model)*MAX77818_OCV_LENGTH, GFP_KERNEL);
 	if (!ocv_model) {
 		dev_err(fg->dev,  "%s: memory allocation failed\n",  __func__);
 		return -ENOMEM;
 	}
+	pdata->battery_ocv_model = ocv_model;
+
+	ret_val = max77818_fg_load_profile(fg, np);
+	if (!ret_val)
+		return 0;
+	if (ret_val != -ENOENT)
+		dev_warn(fg->dev, "battery profile not usable, falling back to DT: %d\n",
+			 ret_val);
+
 	if (of_property_read_u32_array(np, "battery_ocv_model", ocv_model, MAX77818_OCV_LENGTH)) {
 		dev_warn(fg->dev, "OCV table not found\n");
+		pdata->battery_ocv_model = NULL;
 		kfree(ocv_model);
 		return -EINVAL;
 	}
-	pdata->battery_ocv_model = ocv_model;
 
 	if (of_property_read_u32(np, "design_cap", &pdata->design_cap)) {
 		dev_err(fg-> dev, "Property design_cap not found.\n");
@@ -1588,78 +3993,207 @@ static int max77818_fg_alert_init(struct max77818_fg_dev *fg)
 	return 0;
 }
 
-static irqreturn_t max77818_fg_isr(int irq, void *dev) {
+static void max77818_fg_event(struct max77818_fg_dev *fg, unsigned int status)
+{
+	struct max77818_event event = {
+		.source = MAX77818_EVENT_FG,
+		.alerts = status,
+		.old_state = MAX77818_EVENT_NA,
+		.new_state = MAX77818_EVENT_NA,
+		.soc = MAX77818_EVENT_NA,
+		.vcell_uv = MAX77818_EVENT_NA,
+		.curr_ua = MAX77818_EVENT_NA,
+		.temp = MAX77818_EVENT_NA,
+	};
+
+	if (!max77818_event_listeners())
+		return;
+
+	max77818_fg_get_capacity(fg, &event.soc);
+	max77818_fg_get_voltage_now(fg, &event.vcell_uv);
+	max77818_fg_get_current_now(fg, &event.curr_ua);
+	max77818_fg_get_temp(fg, &event.temp);
+
+	max77818_event_notify(fg->max77818, &event);
+}
+
+static int max77818_fg_clear_status(struct max77818_fg_dev *fg)
+{
+	int ret_val;
 
+	ret_val = max77818_fg_write_custom_reg(fg, REG_Status, 0x0000);
+	fg->status_dirty = ret_val != 0;
 
-	struct max77818_fg_dev *fg = dev;
+	return ret_val;
+}
+
+static int max77818_fg_handle_status(struct max77818_fg_dev *fg, int *status)
+{
 	int ret_val;
 	int vcell = 0, soc = 0, data = 0, temp = 0;
-
+	unsigned int cycles;
 
 	ret_val = max77818_fg_read_custom_reg(fg, REG_Status, &data);
 	if (ret_val)
-		return IRQ_NONE;
+		return ret_val;
+	*status = data;
 
 	if (data & BIT_dSOCi) {
 		max77818_fg_get_voltage_now(fg, &vcell);
 		max77818_fg_get_capacity(fg, &soc);
 		dev_info(fg->dev, "max77818 fuelgauge status changed: SOC=%d, VCELL=%d\n", soc, vcell);
 		power_supply_changed(fg->fuelgauge);
+
+		if (fg->learned_cell) {
+			mutex_lock(&fg->xfer_lock);
+			if (!max77818_fg_read_custom_reg(fg, REG_Cycles, &cycles) &&
+			    (cycles < fg->checkpoint_cycles ||
+			     cycles - fg->checkpoint_cycles >= MAX77818_CHECKPOINT_CYCLES))
+				schedule_work(&fg->checkpoint_work);
+			mutex_unlock(&fg->xfer_lock);
+		}
 	}
 
+	max77818_fg_hwmon_alarm(fg, data);
+
 	if (data & BIT_Tmx || data & BIT_Tmn) {
 		dev_dbg(fg->dev, "Temperature alert activated: %d\n", temp);
 		max77818_fg_get_temp(fg, &temp);
+		mutex_lock(&fg->xfer_lock);
 		switch (fg->temp_status) {
 		case MAX77818_TEMP_LOW:
 			if(data & BIT_Tmn) {
 				//emergency shutdown after timeout
 				dev_err(fg->dev, "Temperature level critical low: %d. Shutting down...", temp);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, 0x7f80);
-				mod_timer(&shutdown_timer, jiffies + msecs_to_jiffies(30000));
+				mod_timer(&fg->shutdown_timer, jiffies + msecs_to_jiffies(30000));
 			} else if (data & BIT_Tmx) {
 				dev_info(fg->dev, "Temperature level back to normal: %d", temp);
-				fg->temp_status = MAX77818_TEMP_NORMAL;
-				blocking_notifier_call_chain(&mode_notifier_list,5,NULL);
+				WRITE_ONCE(fg->temp_status, MAX77818_TEMP_NORMAL);
+				max77818_fg_thermal_vote(fg);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, fg->pdata->talrt_norm);
 			}
 			break;
 		case MAX77818_TEMP_NORMAL:
 			if(data & BIT_Tmn) {
 				dev_warn(fg->dev, "Temperature level low: %d", temp);
-				fg->temp_status = MAX77818_TEMP_LOW;
-				blocking_notifier_call_chain(&mode_notifier_list,4,NULL);
+				WRITE_ONCE(fg->temp_status, MAX77818_TEMP_LOW);
+				max77818_fg_thermal_vote(fg);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, fg->pdata->talrt_low);
 			} else if (data & BIT_Tmx) {
 				dev_warn(fg->dev, "Temperature level high: %d", temp);
-				fg->temp_status = MAX77818_TEMP_HIGH;
-				blocking_notifier_call_chain(&mode_notifier_list,4,NULL);
+				WRITE_ONCE(fg->temp_status, MAX77818_TEMP_HIGH);
+				max77818_fg_thermal_vote(fg);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, fg->pdata->talrt_high);
 			}
 			break;
 		case MAX77818_TEMP_HIGH:
 			if(data & BIT_Tmn) {
 				dev_info(fg->dev, "Temperature level back to normal: %d", temp);
-				fg->temp_status = MAX77818_TEMP_NORMAL;
-				blocking_notifier_call_chain(&mode_notifier_list,5,NULL);
+				WRITE_ONCE(fg->temp_status, MAX77818_TEMP_NORMAL);
+				max77818_fg_thermal_vote(fg);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, fg->pdata->talrt_norm);
 			} else if (data & BIT_Tmx) {
 				//emergency shutdown after timeout
 				dev_err(fg->dev, "Temperature level critical high: %d. Shutting down", temp);
 				max77818_fg_write_custom_reg(fg, REG_TAlrtTh, 0x7f80);
-				mod_timer(&shutdown_timer, jiffies + msecs_to_jiffies(30000));
+				mod_timer(&fg->shutdown_timer, jiffies + msecs_to_jiffies(30000));
 			}
 			break;
 		}
+		mutex_unlock(&fg->xfer_lock);
 	}
 
-	ret_val = max77818_fg_write_custom_reg(fg, REG_Status, 0x0000);
-	if (ret_val)
-		return IRQ_NONE;
+	max77818_fg_event(fg, data);
+
+	return max77818_fg_clear_status(fg);
+}
+
+/*
+ * The alert line is level triggered and stays asserted until Status is
+ * cleared. If the bus gives up even after the core retries, mask the line
+ * and drain Status from a work item with growing delays, instead of
+ * returning IRQ_NONE and taking the interrupt again right away.
+ */
+static irqreturn_t max77818_fg_isr(int irq, void *dev)
+{
+	struct max77818_fg_dev *fg = dev;
+	int status;
+
+	/* A flapping alert is handled at the poll rate until it settles */
+	if (max77818_irq_storm(&fg->irq_rate)) {
+		disable_irq_nosync(fg->virq);
+		fg->irq_quiet = jiffies;
+		dev_warn(fg->dev, "alert storm, masked and polled (%u times)\n",
+			 fg->irq_rate.storms);
+		schedule_delayed_work(&fg->irq_storm_work,
+				      msecs_to_jiffies(MAX77818_IRQ_POLL_MS));
+		return IRQ_HANDLED;
+	}
+
+	if (max77818_fg_handle_status(fg, &status)) {
+		disable_irq_nosync(fg->virq);
+		fg->irq_retries = 0;
+		schedule_delayed_work(&fg->irq_retry_work,
+				      msecs_to_jiffies(MAX77818_FG_IRQ_RETRY_MS));
+	}
 
 	return IRQ_HANDLED;
 }
 
+static void max77818_fg_irq_retry_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(to_delayed_work(work),
+						  struct max77818_fg_dev, irq_retry_work);
+	int status, ret_val;
+
+	/* Alerts that were already handled are not replayed */
+	if (fg->status_dirty)
+		ret_val = max77818_fg_clear_status(fg);
+	else
+		ret_val = max77818_fg_handle_status(fg, &status);
+
+	if (ret_val && ++fg->irq_retries < MAX77818_FG_IRQ_RETRIES) {
+		schedule_delayed_work(&fg->irq_retry_work,
+				      msecs_to_jiffies(MAX77818_FG_IRQ_RETRY_MS << fg->irq_retries));
+		return;
+	}
+
+	if (fg->irq_retries >= MAX77818_FG_IRQ_RETRIES)
+		dev_err(fg->dev, "Status still not serviced, re-arming alert\n");
+
+	enable_irq(fg->virq);
+}
+
+static void max77818_fg_irq_storm_work(struct work_struct *work)
+{
+	struct max77818_fg_dev *fg = container_of(to_delayed_work(work),
+						  struct max77818_fg_dev, irq_storm_work);
+	int status = 0;
+
+	if (max77818_fg_handle_status(fg, &status) ||
+	    (status & MAX77818_FG_STATUS_ALERTS)) {
+		fg->irq_quiet = jiffies;
+	} else if (time_after(jiffies, fg->irq_quiet +
+			      msecs_to_jiffies(MAX77818_IRQ_QUIET_MS))) {
+		dev_info(fg->dev, "alert quiet, re-armed\n");
+		enable_irq(fg->virq);
+		return;
+	}
+
+	schedule_delayed_work(&fg->irq_storm_work,
+			      msecs_to_jiffies(MAX77818_IRQ_POLL_MS));
+}
+
+/* The works re-enable the line, keep it masked until they are gone */
+static void max77818_fg_free_irq(struct max77818_fg_dev *fg)
+{
+	disable_irq(fg->virq);
+	cancel_delayed_work_sync(&fg->irq_retry_work);
+	cancel_delayed_work_sync(&fg->irq_storm_work);
+	free_irq(fg->virq, fg);
+}
+
 static int max77818_fg_probe(struct platform_device *pdev)
 {
 	struct max77818_dev *max77818 = dev_get_drvdata(pdev->dev.parent);
@@ -1668,6 +4202,7 @@ static int max77818_fg_probe(struct platform_device *pdev)
 	struct max77818_fg_dev *fg;
 	struct power_supply *fuelgauge;
 
+	struct power_supply_config psy_cfg = {};
 	int ret_val = 0;
 
 	fg = kzalloc(sizeof(*fg), GFP_KERNEL);
@@ -1686,14 +4221,13 @@ static int max77818_fg_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	}
 
-	timer_setup(&shutdown_timer, shutdown_timer_callback, 0);
-
 	fg->pdata = pdata;
 	fg->learned = learned;
 	fg->dev = &pdev->dev;
 	fg->max77818 = max77818;
 	fg->regmap = max77818->regmap_fg;
 	fg->irq_chip = max77818->irq_chip_src;
+	timer_setup(&fg->shutdown_timer, shutdown_timer_callback, 0);
 
 	platform_set_drvdata(pdev, fg);
 
@@ -1704,10 +4238,32 @@ static int max77818_fg_probe(struct platform_device *pdev)
 		return ret_val;
 	}
 
-	max77818_fg_config.drv_data = fg;
+	fg->psy_desc = max77818_fg_desc;
+	fg->psy_desc.name = max77818_fg_instance_name(fg, max77818_fg_desc.name, '-');
+	if (!fg->psy_desc.name)
+		return -ENOMEM;
 
-	fuelgauge = power_supply_register(fg->dev,  &max77818_fg_desc,
-					  &max77818_fg_config);
+	fg->charger_name = max77818_fg_instance_name(fg, "max77818-chg", '-');
+	if (!fg->charger_name)
+		return -ENOMEM;
+	fg->chg_status = POWER_SUPPLY_STATUS_UNKNOWN;
+
+	INIT_WORK(&fg->checkpoint_work, max77818_fg_checkpoint_work);
+	INIT_WORK(&fg->atrate_work, max77818_fg_atrate_work);
+	INIT_LIST_HEAD(&fg->atrate_queue);
+	spin_lock_init(&fg->atrate_lock);
+	INIT_DELAYED_WORK(&fg->energy_work, max77818_fg_energy_work);
+	seqlock_init(&fg->sample_lock);
+	mutex_init(&fg->xfer_lock);
+	INIT_DELAYED_WORK(&fg->budget_work, max77818_fg_budget_work);
+	BLOCKING_INIT_NOTIFIER_HEAD(&fg->budget_notifier);
+	INIT_WORK(&fg->self_test_work, max77818_fg_self_test_work);
+	INIT_DELAYED_WORK(&fg->irq_retry_work, max77818_fg_irq_retry_work);
+	INIT_DELAYED_WORK(&fg->irq_storm_work, max77818_fg_irq_storm_work);
+
+	psy_cfg.drv_data = fg;
+
+	fuelgauge = power_supply_register(fg->dev,  &fg->psy_desc, &psy_cfg);
 	if (IS_ERR(fuelgauge)) {
 		return PTR_ERR(fuelgauge);
 	}
@@ -1727,7 +4283,11 @@ static int max77818_fg_probe(struct platform_device *pdev)
 		goto err_virq;
 	}
 
+	mutex_lock(&fg->xfer_lock);
 	ret_val = max77818_fg_reg_init(fg);
+	if (!ret_val && fg->learned_cell)
+		max77818_fg_read_custom_reg(fg, REG_Cycles, &fg->checkpoint_cycles);
+	mutex_unlock(&fg->xfer_lock);
 	if (ret_val) {
 		dev_err(fg->dev, "%s: reg init failed: %d\n",
 			__func__, ret_val);
@@ -1815,24 +4375,108 @@ static int max77818_fg_probe(struct platform_device *pdev)
 
 	ret_val = device_create_file(fg->dev, &dev_attr_self_test);
 	if (ret_val) {
-		dev_err(&pdev->dev, "fail to create ain0 file\n");
+		dev_err(&pdev->dev, "fail to create self_test file\n");
+		goto err_self_test;
+	}
+
+	ret_val = device_create_file(fg->dev, &dev_attr_self_test_result);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create self_test_result file\n");
 		goto err_self_test;
 	}
 
+	ret_val = device_create_file(fg->dev, &dev_attr_self_test_timestamp);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create self_test_timestamp file\n");
+		goto err_self_test_result;
+	}
+
 	ret_val = device_create_file(fg->dev, &dev_attr_ain0);
 	if (ret_val) {
 		dev_err(&pdev->dev, "fail to create ain0 file\n");
+		goto err_self_test_timestamp;
+	}
+
+	ret_val = device_create_bin_file(fg->dev, &bin_attr_learned_params);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create learned_params file\n");
 		goto err;
 	}
 
-	//Sync temperature and charger mode after chgarger driver is loaded
-	INIT_DELAYED_WORK(&fg->d_work, temperature_sync_work_handler);
-	schedule_delayed_work(&fg->d_work, msecs_to_jiffies(1000));
+	ret_val = device_create_file(fg->dev, &dev_attr_telemetry_rate);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create telemetry_rate file\n");
+		goto err_learned_params;
+	}
+
+	ret_val = device_create_file(fg->dev, &dev_attr_energy_charged);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create energy_charged file\n");
+		goto err_telemetry_rate;
+	}
+
+	ret_val = device_create_file(fg->dev, &dev_attr_energy_discharged);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create energy_discharged file\n");
+		goto err_energy_charged;
+	}
+
+	ret_val = device_create_file(fg->dev, &dev_attr_power_budget);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create power_budget file\n");
+		goto err_energy_discharged;
+	}
+
+	ret_val = max77818_fg_telem_init(fg);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to register telemetry device\n");
+		goto err_power_budget;
+	}
+
+	ret_val = max77818_fg_iio_init(fg);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to register iio device: %d\n", ret_val);
+		goto err_telemetry;
+	}
+
+	ret_val = max77818_fg_hwmon_init(fg);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to register hwmon device: %d\n", ret_val);
+		goto err_telemetry;
+	}
+
+	ret_val = max77818_fg_pmu_init(fg);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to register perf pmu: %d\n", ret_val);
+		goto err_telemetry;
+	}
+
+	schedule_delayed_work(&fg->energy_work, 0);
+	schedule_delayed_work(&fg->budget_work, 0);
+
+	/* The core hands the effective mode to the charger whenever it binds */
+	max77818_fg_thermal_vote(fg);
 
 	return 0;
 
+err_telemetry:
+	max77818_fg_telem_exit(fg);
+err_power_budget:
+	device_remove_file(fg->dev, &dev_attr_power_budget);
+err_energy_discharged:
+	device_remove_file(fg->dev, &dev_attr_energy_discharged);
+err_energy_charged:
+	device_remove_file(fg->dev, &dev_attr_energy_charged);
+err_telemetry_rate:
+	device_remove_file(fg->dev, &dev_attr_telemetry_rate);
+err_learned_params:
+	device_remove_bin_file(fg->dev, &bin_attr_learned_params);
 err:
 	device_remove_file(fg->dev, &dev_attr_ain0);
+err_self_test_timestamp:
+	device_remove_file(fg->dev, &dev_attr_self_test_timestamp);
+err_self_test_result:
+	device_remove_file(fg->dev, &dev_attr_self_test_result);
 err_self_test:
 	device_remove_file(fg->dev, &dev_attr_self_test);
 err_load_params:
@@ -1860,6 +4504,10 @@ err_temp_co:
 err_rcomp0:
 err_alert_init:
 err_reg_init:
+	max77818_fg_free_irq(fg);
+	max77818_fg_self_test_cancel(fg);
+	flush_work(&fg->atrate_work);
+	cancel_work_sync(&fg->checkpoint_work);
 err_virq:
 	power_supply_unregister(fg->fuelgauge);
 	return ret_val;
@@ -1869,9 +4517,19 @@ int max77818_fg_remove(struct platform_device *pdev)
 {
 	struct max77818_fg_dev *fg;
 	fg = platform_get_drvdata(pdev);
+	max77818_fg_pmu_exit(fg);
+	max77818_fg_telem_exit(fg);
+	device_remove_file(fg->dev, &dev_attr_power_budget);
+	device_remove_file(fg->dev, &dev_attr_energy_discharged);
+	device_remove_file(fg->dev, &dev_attr_energy_charged);
+	device_remove_file(fg->dev, &dev_attr_telemetry_rate);
+	device_remove_bin_file(fg->dev, &bin_attr_learned_params);
 	device_remove_file(fg->dev, &dev_attr_ain0);
+	device_remove_file(fg->dev, &dev_attr_self_test_timestamp);
+	device_remove_file(fg->dev, &dev_attr_self_test_result);
 	device_remove_file(fg->dev, &dev_attr_self_test);
 	device_remove_file(fg->dev, &dev_attr_load_params);
+	device_remove_file(fg->dev, &dev_attr_learned_cv_halftime);
 	device_remove_file(fg->dev, &dev_attr_learned_cv_mixcap);
 	device_remove_file(fg->dev, &dev_attr_learned_qresidual30);
 	device_remove_file(fg->dev, &dev_attr_learned_qresidual20);
@@ -1882,10 +4540,26 @@ int max77818_fg_remove(struct platform_device *pdev)
 	device_remove_file(fg->dev, &dev_attr_learned_full_cap_rep);
 	device_remove_file(fg->dev, &dev_attr_learned_temp_co);
 	device_remove_file(fg->dev, &dev_attr_learned_rcomp0);
+	max77818_fg_free_irq(fg);
+	flush_work(&fg->atrate_work);
+	cancel_delayed_work_sync(&fg->energy_work);
+	cancel_delayed_work_sync(&fg->budget_work);
+	max77818_fg_self_test_cancel(fg);
+	del_timer_sync(&fg->shutdown_timer);
+	max77818_mode_unvote(fg->max77818, MAX77818_VOTER_THERMAL);
 	power_supply_unregister(fg->fuelgauge);
+	cancel_work_sync(&fg->checkpoint_work);
 	return 0;
 }
 
+static void max77818_fg_shutdown(struct platform_device *pdev)
+{
+	struct max77818_fg_dev *fg = platform_get_drvdata(pdev);
+
+	cancel_work_sync(&fg->checkpoint_work);
+	max77818_fg_checkpoint_learned(fg);
+}
+
 static const struct of_device_id max77818_fg_of_ids[] = {
 	{ .compatible = "maxim,max77818-fg" },
 	{   },
@@ -1906,10 +4580,35 @@ static struct platform_driver max77818_fg_driver = {
 	},
 	.probe = max77818_fg_probe,
 	.remove = max77818_fg_remove,
+	.shutdown = max77818_fg_shutdown,
 	.id_table = max77818_fg_id,
 };
 
-module_platform_driver(max77818_fg_driver);
+static int __init max77818_fg_init(void)
+{
+	int ret_val;
+
+	ret_val = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN,
+					  "power/max77818:online", NULL,
+					  max77818_fg_pmu_offline_cpu);
+	if (ret_val < 0)
+		return ret_val;
+	max77818_fg_pmu_hp_state = ret_val;
+
+	ret_val = platform_driver_register(&max77818_fg_driver);
+	if (ret_val)
+		cpuhp_remove_multi_state(max77818_fg_pmu_hp_state);
+
+	return ret_val;
+}
+module_init(max77818_fg_init);
+
+static void __exit max77818_fg_exit(void)
+{
+	platform_driver_unregister(&max77818_fg_driver);
+	cpuhp_remove_multi_state(max77818_fg_pmu_hp_state);
+}
+module_exit(max77818_fg_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Nebojsa Stojiljkovic <nebojsa@keemail.me>");
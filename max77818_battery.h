@@ -3,6 +3,8 @@
 #ifndef __LINUX_MAX77818_FG_
 #define __LINUX_MAX77818_FG_
 
+#include <linux/max77818.h>
+
 #define MAX77818_OCV_LENGTH        48
 
 #define MAX77818_BATTERY_FULL      95
@@ -15,10 +17,18 @@
 #define MAX77818_MODEL_UNLOCK2     0x00C4
 #define MAX77818_MODEL_LOCK        0x0000
 
-enum max77818_temp_status {
-	MAX77818_TEMP_LOW,
-	MAX77818_TEMP_NORMAL,
-	MAX77818_TEMP_HIGH,
+#define MAX77818_VFSOC0_UNLOCK     0x0080
+#define MAX77818_VFSOC0_LOCK       0x0000
+#define MAX77818_CMD_SOFT_WAKEUP   0x0090
+#define MAX77818_CMD_CLEAR         0x0000
+
+#define MAX77818_DNR_TIMEOUT_US    1000000
+#define MAX77818_LDMDL_TIMEOUT_US  1000000
+
+enum max77818_fg_init_action {
+	MAX77818_INIT_SKIP,
+	MAX77818_INIT_CONFIG,
+	MAX77818_INIT_FULL,
 };
 
 
@@ -64,6 +74,15 @@ struct max77818_fg_platform_data {
 	unsigned int talrt_low;
 	unsigned int talrt_norm;
 	unsigned int talrt_high;
+
+	/*
+	 * First of two consecutive scratch registers holding the model and
+	 * configuration fingerprints, 0 when not used.
+	 */
+	unsigned int fingerprint_reg;
+
+	/* Nominal cell voltage in uV, used to convert charge to energy */
+	unsigned int nominal_voltage;
 };
 
 struct max77818_fg_learned_params {
@@ -82,10 +101,139 @@ struct max77818_fg_learned_params {
 	unsigned int cv_halftime;
 };
 
+#define MAX77818_LEARNED_MAGIC     0x504C384D  /* "M8LP" */
+#define MAX77818_LEARNED_VERSION   1
+
+/* Checkpoint learned params every time Cycles advances by 64% */
+#define MAX77818_CHECKPOINT_CYCLES 0x0040
+
+/*
+ * Binary image of max77818_fg_learned_params exposed through the
+ * learned_params sysfs file. Registers are stored in the same order as
+ * the fields of max77818_fg_learned_params, crc is CRC-32 (IEEE 802.3)
+ * of all preceding bytes.
+ */
+struct max77818_fg_learned_blob {
+	__le32 magic;
+	__le16 version;
+	__le16 count;
+	__le16 regs[MAX77818_LEARNED_COUNT];
+	__le32 crc;
+} __packed;
+
+#define MAX77818_PROFILE_MAGIC     0x4650384D  /* "M8PF" */
+#define MAX77818_PROFILE_VERSION   1
+#define MAX77818_PROFILE_MAX       4
+
+/*
+ * Battery profile firmware image, loaded with request_firmware() and
+ * selected by the pack ID resistor measured on AIN0. All fields are
+ * little endian, crc is CRC-32 (IEEE 802.3) of all preceding bytes.
+ */
+struct max77818_battery_profile {
+	__le32 magic;
+	__le16 version;
+	__le16 size;
+
+	__le16 ocv[MAX77818_OCV_LENGTH];
+
+	/* Fuelgauge configuration registers */
+	__le16 design_cap;
+	__le16 config;
+	__le16 config2;
+	__le16 dqacc;
+	__le16 dpacc;
+	__le16 filter_cfg;
+	__le16 full_cap_nom;
+	__le16 full_cap_rep;
+	__le16 full_soc_thr;
+	__le16 iavg_empty;
+	__le16 i_chg_term;
+	__le16 learn_cfg;
+	__le16 qresidual00;
+	__le16 qresidual10;
+	__le16 qresidual20;
+	__le16 qresidual30;
+	__le16 rcomp0;
+	__le16 relax_cfg;
+	__le16 temp_co;
+	__le16 v_empty;
+	__le16 tgain;
+	__le16 toff;
+	__le16 curve;
+	__le16 at_rate;
+	__le16 cv_mixcap;
+	__le16 cv_halftime;
+	__le16 smartchgcfg;
+	__le16 convg_cfg;
+	__le16 talrt_low;
+	__le16 talrt_norm;
+	__le16 talrt_high;
+	__le16 reserved;
+
+	/* Charger limits, same units as the charger DT properties */
+	__le32 fast_charge_timer_timeout;
+	__le32 charge_current_limit;
+	__le32 topoff_current_threshold;
+	__le32 topoff_timer_timeout;
+	__le32 prim_charge_term_voltage;
+	__le32 battery_overcurrent_threshold;
+
+	__le32 crc;
+} __packed;
+
+#define MAX77818_TELEM_RECORDS     4096
+#define MAX77818_TELEM_RATE_DEF    100
+#define MAX77818_TELEM_RATE_MAX    2000
+
+#define MAX77818_NOMINAL_VOLTAGE_DEF  3850000
+#define MAX77818_ENERGY_PERIOD_MS     1000
+#define MAX77818_ENERGY_FAST_MS       10      /* While a PMU event samples */
+#define MAX77818_PMU_MIN_PERIOD_NS    (MAX77818_ENERGY_FAST_MS * NSEC_PER_MSEC)
+#define MAX77818_BUDGET_PERIOD_MS     1000
+#define MAX77818_BUDGET_HYST_PCT      5
+#define MAX77818_SELF_TEST_MS         5000
+#define MAX77818_FG_IRQ_RETRY_MS      10
+#define MAX77818_FG_IRQ_RETRIES       6
+#define MAX77818_FG_STATUS_ALERTS     (0xffff & ~BIT_Bst)  /* Bst is a level, not an alert */
+
+/* Converted measurement snapshot, voltages in uV, currents in uA */
+struct max77818_fg_sample {
+	ktime_t timestamp;
+	int vcell;
+	int curr;
+	int avg_vcell;
+	int avg_curr;
+	int soc;            /* % */
+	int temp;           /* 0.1 C */
+};
+
+#define MAX77818_ATRATE_SETTLE_MS  400
+#define MAX77818_ATRATE_TRIES      3
+
+/*
+ * Character device of a fuelgauge. Open files and mappings hold a reference,
+ * so it outlives an unbind; fg is cleared then and the ioctls fail.
+ */
+struct max77818_fg_cdev {
+	struct kref ref;
+	struct miscdevice miscdev;
+	struct rw_semaphore lock;   /* fg against the ioctls in flight */
+	struct max77818_fg_dev *fg;
+
+	struct mutex telem_lock;    /* telem_thread, telem_users */
+	struct task_struct *telem_thread;
+	unsigned int telem_users;
+	void *telem_buf;
+};
+
 struct max77818_fg_dev {
 
 	struct device *dev;
 	struct power_supply *fuelgauge;
+	struct power_supply_desc psy_desc;
+	const char *charger_name;
+	int chg_status;             /* Charger STATUS, cached on change */
 
 	struct regmap *regmap;
 	struct regmap_irq_chip_data *irq_chip;
@@ -93,11 +241,62 @@ struct max77818_fg_dev {
 	struct max77818_fg_platform_data *pdata;
 	struct max77818_fg_learned_params *learned;
 
-	struct delayed_work d_work;
+	struct timer_list shutdown_timer;
+
+	struct nvmem_cell *learned_cell;
+	struct work_struct checkpoint_work;
+	unsigned int checkpoint_cycles; /* xfer_lock */
+
+	struct max77818_fg_cdev *cdev;
+	unsigned int telem_rate;
+
+	spinlock_t atrate_lock;
+	struct list_head atrate_queue;
+	struct work_struct atrate_work;
+
+	seqlock_t sample_lock;      /* sample and energy, never waits on I2C */
+	struct max77818_fg_sample sample;
+	struct delayed_work energy_work;
+	u64 energy_charged;         /* nJ */
+	u64 energy_discharged;      /* nJ */
+
+	struct pmu pmu;
+	struct hlist_node pmu_node;
+	unsigned int pmu_cpu;       /* CPU the events run on, moved on hotplug */
+	atomic_t pmu_samplers;      /* Sampling events started */
+
+	struct delayed_work budget_work;
+	struct blocking_notifier_head budget_notifier;
+	unsigned int budget;        /* uW */
+
+	struct delayed_work irq_retry_work;
+	unsigned int irq_retries;
+	bool status_dirty;          /* Alerts handled, Status clear still pending */
+	struct max77818_irq_rate irq_rate;
+	struct delayed_work irq_storm_work;
+	unsigned long irq_quiet;    /* jiffies of the last alert while masked */
+
+	struct work_struct self_test_work;
+	unsigned long self_test_busy;
+	int self_test_result;
+	u64 self_test_time;
+
+	struct iio_dev *indio_dev;
+
+	struct device *hwmon_dev;
+	unsigned long hwmon_alarms;
 
 	enum max77818_temp_status temp_status;
+	struct mutex xfer_lock;     /* multi-register transactions, learned */
 
 	int virq;
 };
 
+int max77818_fg_atrate_query(struct max77818_fg_dev *fg,
+			     struct max77818_atrate_query *q, unsigned int count);
+int max77818_fg_register_budget_notifier(struct max77818_fg_dev *fg,
+					 struct notifier_block *nb);
+int max77818_fg_unregister_budget_notifier(struct max77818_fg_dev *fg,
+					   struct notifier_block *nb);
+
 #endif
@@ -8,6 +8,8 @@
 #include <linux/irq.h>
 #include <linux/interrupt.h>
 #include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 #include <linux/mfd/max77818-private.h>
 #include <linux/mfd/max77818.h>
@@ -26,13 +28,13 @@ static enum power_supply_property max77818_chg_props[] = {
 	POWER_SUPPLY_PROP_ONLINE,
 };
 
-static struct max77818_chg_irqs irqs[] = {
-	{.name = MAX77818_CHG_BYP_INT,  .virq = 0},
-	{.name = MAX77818_CHG_BATP_INT, .virq = 0},
-	{.name = MAX77818_CHG_BAT_INT,  .virq = 0},
-	{.name = MAX77818_CHG_CHG_INT,  .virq = 0},
-	{.name = MAX77818_CHG_WCIN_INT, .virq = 0},
-	{.name = MAX77818_CHG_AICL_INT, .virq = 0},
+static const struct max77818_chg_irqs max77818_chg_default_irqs[] = {
+	{.name = MAX77818_CHG_BYP_INT,   .virq = 0, .mask = BIT_OK_BYP_I},
+	{.name = MAX77818_CHG_BATP_INT,  .virq = 0, .mask = BIT_OK_BATP_I},
+	{.name = MAX77818_CHG_BAT_INT,   .virq = 0, .mask = BIT_OK_BAT_I},
+	{.name = MAX77818_CHG_CHG_INT,   .virq = 0, .mask = BIT_OK_CHG_I},
+	{.name = MAX77818_CHG_WCIN_INT,  .virq = 0, .mask = BIT_OK_WCIN_I},
+	{.name = MAX77818_CHG_CHGIN_INT, .virq = 0, .mask = BIT_OK_CHGIN_I},
 };
 
 
@@ -73,17 +75,32 @@ static int max77818_chg_get_charge_type(struct max77818_chg_dev *chg,  int *val)
 	return 0;
 }
 
-static int max77818_chg_get_charge_status(struct max77818_chg_dev *chg, int *val)
+/* Refresh the CHG_DTLS cache, called whenever the charger state may change */
+static int max77818_chg_update_dtls(struct max77818_chg_dev *chg)
 {
 	int ret_val;
 	unsigned int data;
 
 	ret_val = regmap_read(chg->regmap, REG_CHG_DETAILS_01, &data);
-
 	if (ret_val < 0)
 		return ret_val;
 
-	switch ((data & BIT_CHG_DTLS) >> FFS(BIT_CHG_DTLS)) {
+	WRITE_ONCE(chg->chg_dtls, (data & BIT_CHG_DTLS) >> FFS(BIT_CHG_DTLS));
+
+	return 0;
+}
+
+static int max77818_chg_get_charge_status(struct max77818_chg_dev *chg, int *val)
+{
+	int ret_val;
+
+	if (READ_ONCE(chg->chg_dtls) < 0) {
+		ret_val = max77818_chg_update_dtls(chg);
+		if (ret_val < 0)
+			return ret_val;
+	}
+
+	switch (READ_ONCE(chg->chg_dtls)) {
 	case MAX77818_CHARGING_TOP_OFF:
 		*val = POWER_SUPPLY_STATUS_CHARGING;
 		break;
@@ -457,6 +474,8 @@ static int max77818_chg_set_mode(struct max77818_chg_dev *chg, int val)
 	int ret_val;
 	unsigned int data;
 
+	lockdep_assert_held(&chg->xfer_lock);
+
 	data = val << FFS(BIT_MODE);
 
 	ret_val = regmap_update_bits(chg->regmap, REG_CHG_CNFG_00, BIT_MODE, data);
@@ -541,10 +560,6 @@ static int max77818_chg_get_property(struct power_supply *psy,
 	return ret_val;
 }
 
-static struct power_supply_config max77818_chg_config = {
-
-};
-
 static const struct power_supply_desc max77818_chg_desc = {
 
 	.name = "max77818-chg",
@@ -561,6 +576,8 @@ static int max77818_chg_reg_init(struct max77818_chg_dev *chg)
 	int ret_val;
 	struct max77818_chg_platform_data *pdata = chg->pdata;
 
+	lockdep_assert_held(&chg->xfer_lock);
+
 	ret_val = regmap_update_bits(chg->regmap, REG_CHG_CNFG_06,
 					BIT_CHGPROT, 0x03 << FFS(BIT_CHGPROT));
 	if(ret_val)
@@ -689,6 +706,7 @@ static int max77818_chg_parse_dt(struct max77818_chg_dev *chg)
 				&pdata->chgin_input_voltage_threshold))
 		pdata->chgin_input_voltage_threshold = 4300000;
 
+
 	dev_dbg(chg->dev, "fast_charge_timer_timeout: %d sec\n",
 		pdata->fast_charge_timer_timeout);
 
@@ -728,12 +746,100 @@ static int max77818_chg_parse_dt(struct max77818_chg_dev *chg)
 	return 0;
 }
 
+/*
+ * Mask a source that fires faster than the storm threshold, its state is
+ * then followed by max77818_chg_storm_work() until it settles.
+ */
+static bool max77818_chg_irq_storm(struct max77818_chg_dev *chg,
+				   struct max77818_chg_irqs *src)
+{
+	unsigned int ok;
+
+	if (!max77818_irq_storm(&src->rate))
+		return false;
+
+	disable_irq_nosync(src->virq);
+	src->state = regmap_read(chg->regmap, REG_CHG_INT_OK, &ok) ? 0 : ok & src->mask;
+	src->quiet = jiffies;
+	WRITE_ONCE(src->masked, true);
+
+	dev_warn(chg->dev, "%s storm, masked and polled (%u times)\n",
+		 src->name, src->rate.storms);
+	mod_delayed_work(system_wq, &chg->storm_work,
+			 msecs_to_jiffies(MAX77818_IRQ_POLL_MS));
+
+	return true;
+}
+
+static void max77818_chg_storm_work(struct work_struct *work)
+{
+	struct max77818_chg_dev *chg = container_of(to_delayed_work(work),
+						    struct max77818_chg_dev, storm_work);
+	struct max77818_chg_irqs *src;
+	bool pending = false, changed = false;
+	unsigned int ok;
+	int i;
+
+	if (regmap_read(chg->regmap, REG_CHG_INT_OK, &ok))
+		goto out;
+
+	for (i = 0; i < MAX77818_CHG_MAX_IRQS - 1; i++) {
+		src = &chg->irqs[i];
+		if (!READ_ONCE(src->masked))
+			continue;
+
+		if ((ok & src->mask) != src->state) {
+			src->state = ok & src->mask;
+			src->quiet = jiffies;
+			changed = true;
+		} else if (time_after(jiffies, src->quiet +
+				      msecs_to_jiffies(MAX77818_IRQ_QUIET_MS))) {
+			WRITE_ONCE(src->masked, false);
+			enable_irq(src->virq);
+			dev_info(chg->dev, "%s quiet, re-armed\n", src->name);
+			continue;
+		}
+		pending = true;
+	}
+
+	/* Stand in for the masked interrupts at the poll rate */
+	max77818_chg_update_dtls(chg);
+	if (changed)
+		power_supply_changed(chg->supply);
+out:
+	if (pending)
+		schedule_delayed_work(&chg->storm_work,
+				      msecs_to_jiffies(MAX77818_IRQ_POLL_MS));
+}
+
+static void max77818_chg_event(struct max77818_chg_dev *chg, unsigned int alerts,
+			       int old_state)
+{
+	struct max77818_event event = {
+		.source = MAX77818_EVENT_CHG,
+		.alerts = alerts,
+		.old_state = old_state,
+		.new_state = READ_ONCE(chg->chg_dtls),
+		.soc = MAX77818_EVENT_NA,
+		.vcell_uv = MAX77818_EVENT_NA,
+		.curr_ua = MAX77818_EVENT_NA,
+		.temp = MAX77818_EVENT_NA,
+	};
+
+	max77818_event_notify(chg->max77818, &event);
+}
+
 static irqreturn_t max77818_chg_isr(int irq, void *data)
 {
 	struct max77818_chg_dev *chg = data;
+	int old_state = READ_ONCE(chg->chg_dtls);
 
 	irq = irq - chg->irqs->virq;
 
+	if (irq >= 0 && irq < MAX77818_CHG_MAX_IRQS - 1 &&
+	    max77818_chg_irq_storm(chg, &chg->irqs[irq]))
+		return IRQ_HANDLED;
+
 	switch (irq) {
 	case MAX77818_CHG_IRQ_BATP_I:
 		dev_dbg(chg->dev, "Battery present status updated\n");
@@ -754,8 +860,12 @@ static irqreturn_t max77818_chg_isr(int irq, void *data)
 		break;
 	}
 
+	max77818_chg_update_dtls(chg);
 	power_supply_changed(chg->supply);
 
+	if (irq >= 0 && irq < MAX77818_CHG_MAX_IRQS - 1)
+		max77818_chg_event(chg, chg->irqs[irq].mask, old_state);
+
 	return IRQ_HANDLED;
 }
 
@@ -765,22 +875,27 @@ static int max77818_chg_init_irqs(struct max77818_chg_dev *chg)
 	int ret_val;
 	int i, val;
 
-	chg->irqs = irqs;
+	chg->irqs = devm_kmemdup(chg->dev, max77818_chg_default_irqs,
+				 sizeof(max77818_chg_default_irqs), GFP_KERNEL);
+	if (!chg->irqs)
+		return -ENOMEM;
 
 	for (i = 0; i < MAX77818_CHG_MAX_IRQS - 1; i++) {
 
-		irqs[i].virq = regmap_irq_get_virq(chg->irq_chip, i);
-		if (!irqs[i].virq) {
+		chg->irqs[i].virq = regmap_irq_get_virq(chg->irq_chip, i);
+		if (!chg->irqs[i].virq) {
 			dev_warn(chg->dev, "get virq for %s failed\n",
-				 irqs[i].name);
+				 chg->irqs[i].name);
 		} else {
-			ret_val = request_threaded_irq(irqs[i].virq,
+			ret_val = request_threaded_irq(chg->irqs[i].virq,
 					       NULL, max77818_chg_isr,
 					       IRQF_TRIGGER_LOW | IRQF_ONESHOT,
-					       irqs[i].name, chg);
+					       chg->irqs[i].name, chg);
 			if (ret_val < 0)
-			dev_warn(chg->dev, "thread irq for %s failed\n",
-				 irqs[i].name);
+				dev_warn(chg->dev, "thread irq for %s failed\n",
+					 chg->irqs[i].name);
+			else
+				chg->irqs[i].requested = true;
 		}
 	}
 
@@ -789,6 +904,22 @@ static int max77818_chg_init_irqs(struct max77818_chg_dev *chg)
 	return 0;
 }
 
+/* storm_work re-enables sources, keep them all masked until it is gone */
+static void max77818_chg_free_irqs(struct max77818_chg_dev *chg)
+{
+	int i;
+
+	for (i = 0; i < MAX77818_CHG_MAX_IRQS - 1; i++)
+		if (chg->irqs[i].requested)
+			disable_irq(chg->irqs[i].virq);
+
+	cancel_delayed_work_sync(&chg->storm_work);
+
+	for (i = 0; i < MAX77818_CHG_MAX_IRQS - 1; i++)
+		if (chg->irqs[i].requested)
+			free_irq(chg->irqs[i].virq, chg);
+}
+
 static int mode_event_notify(struct notifier_block *this, unsigned long mode,
 		void *unused)
 {
@@ -796,13 +927,53 @@ static int mode_event_notify(struct notifier_block *this, unsigned long mode,
 
 	chg = container_of(this, struct max77818_chg_dev, mode_notifier);
 
-	dev_info(chg->dev, "mode requested from fg: %lu\n", mode);
-	max77818_chg_set_mode(chg, mode);
+	if (mode == chg->mode)
+		return NOTIFY_DONE;
+
+	dev_info(chg->dev, "mode requested: %lu\n", mode);
+	mutex_lock(&chg->xfer_lock);
+	if (max77818_chg_set_mode(chg, mode)) {
+		mutex_unlock(&chg->xfer_lock);
+		return NOTIFY_DONE;
+	}
+	chg->mode = mode;
+	mutex_unlock(&chg->xfer_lock);
 
+	max77818_chg_update_dtls(chg);
 	power_supply_changed(chg->supply);
 	return NOTIFY_DONE;
 }
 
+/* Battery profile selected by the fuelgauge overrides the DT battery limits */
+static int limits_event_notify(struct notifier_block *this, unsigned long unused,
+		void *data)
+{
+	const struct max77818_battery_limits *limits = data;
+	struct max77818_chg_platform_data *pdata;
+	struct max77818_chg_dev *chg;
+	int ret_val;
+
+	chg = container_of(this, struct max77818_chg_dev, limits_notifier);
+	pdata = chg->pdata;
+
+	mutex_lock(&chg->xfer_lock);
+	pdata->fast_charge_timer_timeout = limits->fast_charge_timer_timeout;
+	pdata->charge_current_limit = limits->charge_current_limit;
+	pdata->topoff_current_threshold = limits->topoff_current_threshold;
+	pdata->topoff_timer_timeout = limits->topoff_timer_timeout;
+	pdata->prim_charge_term_voltage = limits->prim_charge_term_voltage;
+	pdata->battery_overcurrent_threshold = limits->battery_overcurrent_threshold;
+	ret_val = max77818_chg_reg_init(chg);
+	mutex_unlock(&chg->xfer_lock);
+
+	if (ret_val)
+		dev_err(chg->dev, "battery profile limits not applied: %d\n", ret_val);
+	else
+		dev_info(chg->dev, "using battery profile charger limits\n");
+
+	return NOTIFY_DONE;
+}
+
 static ssize_t device_attr_show(struct device *dev,
 		struct device_attribute *attr, char *buf,
 		int (*fn)(struct max77818_chg_dev *, int *))
@@ -825,6 +996,28 @@ static ssize_t max77818_chg_mode_show(struct device *dev,
 			max77818_chg_get_mode);
 }
 
+/* Userspace policy vote, "auto" withdraws it */
+static ssize_t max77818_chg_mode_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct max77818_chg_dev *chg = dev_get_drvdata(dev);
+	unsigned int mode;
+	int ret_val;
+
+	if (sysfs_streq(buf, "auto")) {
+		ret_val = max77818_mode_unvote(chg->max77818, MAX77818_VOTER_USER);
+	} else {
+		ret_val = kstrtouint(buf, 0, &mode);
+		if (ret_val)
+			return ret_val;
+		if (mode > BIT_MODE)
+			return -EINVAL;
+		ret_val = max77818_mode_vote(chg->max77818, MAX77818_VOTER_USER, mode);
+	}
+
+	return ret_val ? ret_val : count;
+}
+
 static ssize_t max77818_chg_byp_dtls_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -832,21 +1025,59 @@ static ssize_t max77818_chg_byp_dtls_show(struct device *dev,
 			max77818_chg_get_byp_dtls);
 }
 
+/* Storms seen per source, "<name>: <count>[ masked]" per line */
+static ssize_t max77818_chg_irq_storms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct max77818_chg_dev *chg = dev_get_drvdata(dev);
+	struct max77818_chg_irqs *src;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < MAX77818_CHG_MAX_IRQS - 1; i++) {
+		src = &chg->irqs[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s: %u%s\n",
+				 src->name, src->rate.storms,
+				 READ_ONCE(src->masked) ? " masked" : "");
+	}
+
+	return len;
+}
+
 
-static DEVICE_ATTR_RO(max77818_chg_mode);
+static DEVICE_ATTR_RW(max77818_chg_mode);
 static DEVICE_ATTR_RO(max77818_chg_byp_dtls);
+static DEVICE_ATTR_RO(max77818_chg_irq_storms);
 
 static int max77818_chg_power_supply_init(struct max77818_chg_dev *chg)
 {
+	struct power_supply_config psy_cfg = {};
 	struct power_supply *supply;
-	max77818_chg_config.drv_data = chg;
 
-	supply = devm_kzalloc(chg->dev, sizeof(*supply), GFP_KERNEL);
-	if (!supply)
-		return -ENOMEM;
+	/* The first PMIC keeps the legacy name */
+	chg->psy_desc = max77818_chg_desc;
+	if (chg->max77818->id) {
+		chg->psy_desc.name = devm_kasprintf(chg->dev, GFP_KERNEL, "%s-%d",
+						    max77818_chg_desc.name,
+						    chg->max77818->id);
+		if (!chg->psy_desc.name)
+			return -ENOMEM;
+	}
+
+	/* Let the fuelgauge of the same PMIC follow the charger state */
+	chg->supplied_to[0] = "max77818-fg";
+	if (chg->max77818->id) {
+		chg->supplied_to[0] = devm_kasprintf(chg->dev, GFP_KERNEL, "%s-%d",
+						     "max77818-fg", chg->max77818->id);
+		if (!chg->supplied_to[0])
+			return -ENOMEM;
+	}
+
+	psy_cfg.drv_data = chg;
+	psy_cfg.supplied_to = chg->supplied_to;
+	psy_cfg.num_supplicants = ARRAY_SIZE(chg->supplied_to);
 
-	supply = power_supply_register(chg->dev, &max77818_chg_desc,
-					&max77818_chg_config);
+	supply = power_supply_register(chg->dev, &chg->psy_desc, &psy_cfg);
 	if (IS_ERR(supply))
 		return PTR_ERR(supply);
 
@@ -881,6 +1112,10 @@ static int max77818_chg_probe(struct platform_device *pdev)
 	chg->regmap = max77818->regmap_chg;
 	chg->irq_chip = max77818->irq_chip_chg;
 	chg->mode_notifier.notifier_call = mode_event_notify;
+	chg->limits_notifier.notifier_call = limits_event_notify;
+	chg->mode = MAX77818_NO_VOTE;
+	chg->chg_dtls = -1;
+	mutex_init(&chg->xfer_lock);
 
 #if defined(CONFIG_OF)
 
@@ -895,16 +1130,28 @@ static int max77818_chg_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, chg);
 
+	/* Keep the CHGPROT unlock window from interleaving with a mode change */
+	mutex_lock(&chg->xfer_lock);
 	ret_val = max77818_chg_reg_init(chg);
+	mutex_unlock(&chg->xfer_lock);
 	if (ret_val) {
 		dev_err(chg->dev, "init chg regs failed: %d\n", ret_val);
 		return ret_val;
 	}
 
+	/* Reapplies the registers if a battery profile is already known */
+	ret_val = register_limits_notifier(chg->max77818, &chg->limits_notifier);
+	if (ret_val) {
+		dev_err(chg->dev, "limits notifier register fail %d\n", ret_val);
+		return ret_val;
+	}
+
+	INIT_DELAYED_WORK(&chg->storm_work, max77818_chg_storm_work);
+
 	ret_val = max77818_chg_init_irqs(chg);
 	if (ret_val) {
 		dev_err(chg->dev, "irqs request failed %d\n", ret_val);
-		return ret_val;
+		goto err_irqs;
 	}
 
 	ret_val = device_create_file(chg->dev, &dev_attr_max77818_chg_mode);
@@ -919,13 +1166,19 @@ static int max77818_chg_probe(struct platform_device *pdev)
 		goto err;
 	}
 
+	ret_val = device_create_file(chg->dev, &dev_attr_max77818_chg_irq_storms);
+	if (ret_val) {
+		dev_err(&pdev->dev, "fail to create charger irq_storms sysfs entry\n");
+		goto err;
+	}
+
 	ret_val = max77818_chg_power_supply_init(chg);
 	if (ret_val) {
 		dev_err(chg->dev, "power supply init failed %d\n", ret_val);
-		return ret_val;
+		goto err;
 	}
 
-	ret_val = register_mode_notifier(&chg->mode_notifier);
+	ret_val = register_mode_notifier(chg->max77818, &chg->mode_notifier);
 	if(ret_val) {
 		dev_err(chg->dev, "mode notifier register fail %d\n", ret_val);
 	}
@@ -935,6 +1188,10 @@ static int max77818_chg_probe(struct platform_device *pdev)
 err:
 	device_remove_file(chg->dev, &dev_attr_max77818_chg_mode);
 	device_remove_file(chg->dev, &dev_attr_max77818_chg_byp_dtls);
+	device_remove_file(chg->dev, &dev_attr_max77818_chg_irq_storms);
+	max77818_chg_free_irqs(chg);
+err_irqs:
+	unregister_limits_notifier(chg->max77818, &chg->limits_notifier);
 
 	return ret_val;
 }
@@ -944,8 +1201,12 @@ static int max77818_chg_remove(struct platform_device *pdev)
 	struct max77818_chg_dev *chg;
 	chg = platform_get_drvdata(pdev);
 
+	unregister_mode_notifier(chg->max77818, &chg->mode_notifier);
+	unregister_limits_notifier(chg->max77818, &chg->limits_notifier);
+	max77818_chg_free_irqs(chg);
 	device_remove_file(chg->dev, &dev_attr_max77818_chg_mode);
 	device_remove_file(chg->dev, &dev_attr_max77818_chg_byp_dtls);
+	device_remove_file(chg->dev, &dev_attr_max77818_chg_irq_storms);
 	power_supply_unregister(chg->supply);
 
 	return 0;
@@ -983,4 +1244,3 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Nebojsa Stojiljkovic <nebojsa@keemail.me");
 MODULE_DESCRIPTION("MAX77818 Charger Driver");
 MODULE_ALIAS("mfd:max77818-chg");
-MODULE_SOFTDEP("pre: max77818-fg");
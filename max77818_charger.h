@@ -31,11 +31,18 @@ struct max77818_chg_platform_data {
 struct max77818_chg_irqs {
 	const char *name;
 	int virq;
+	bool requested;                         /* Handler installed on virq */
+	unsigned int mask;                      /* Source bit in CHG_INT_OK */
+	struct max77818_irq_rate rate;
+	bool masked;                            /* Masked by the storm guard */
+	unsigned int state;                     /* CHG_INT_OK bit seen while polling */
+	unsigned long quiet;                    /* jiffies of the last state change */
 };
 
 struct max77818_chg_dev {
 	struct device *dev;
 	struct power_supply *supply;
+	struct power_supply_desc psy_desc;
 
 	struct regmap *regmap;
 	struct regmap_irq_chip_data *irq_chip;
@@ -43,8 +50,14 @@ struct max77818_chg_dev {
 	struct max77818_chg_platform_data *pdata;
 
 	struct max77818_chg_irqs *irqs;
+	struct delayed_work storm_work;         /* Polls sources masked for storming */
 
+	struct mutex xfer_lock;                 /* CHGPROT window and MODE writes */
 	struct notifier_block mode_notifier;
+	struct notifier_block limits_notifier;
+	int mode;                               /* Last MODE written, -1 if unknown */
+	int chg_dtls;                           /* Cached CHG_DTLS, -1 if unknown */
+	char *supplied_to[1];
 };
 
 enum max77818_charger_details {
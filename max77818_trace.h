@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM max77818
+
+#if !defined(_TRACE_MAX77818_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_MAX77818_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(max77818_mode,
+
+	TP_PROTO(int id, int voter, int vote, int old_mode, int new_mode),
+
+	TP_ARGS(id, voter, vote, old_mode, new_mode),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, voter)
+		__field(int, vote)
+		__field(int, old_mode)
+		__field(int, new_mode)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->voter = voter;
+		__entry->vote = vote;
+		__entry->old_mode = old_mode;
+		__entry->new_mode = new_mode;
+	),
+
+	TP_printk("pmic=%d voter=%d vote=%d mode=%d->%d",
+		  __entry->id, __entry->voter, __entry->vote,
+		  __entry->old_mode, __entry->new_mode)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE max77818_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+
+#ifndef _UAPI_LINUX_MAX77818_H
+#define _UAPI_LINUX_MAX77818_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Generic netlink event channel. Subscribers join MAX77818_GENL_MCGRP of
+ * family MAX77818_GENL_NAME and get one MAX77818_CMD_EVENT per decoded
+ * interrupt, carrying a struct max77818_event in MAX77818_ATTR_EVENT.
+ * The family is only registered in the initial network namespace.
+ */
+#define MAX77818_GENL_NAME      "max77818"
+#define MAX77818_GENL_VERSION   1
+#define MAX77818_GENL_MCGRP     "events"
+
+enum max77818_genl_cmd {
+	MAX77818_CMD_UNSPEC,
+	MAX77818_CMD_EVENT,
+	__MAX77818_CMD_MAX,
+};
+
+enum max77818_genl_attr {
+	MAX77818_ATTR_UNSPEC,
+	MAX77818_ATTR_EVENT,                    /* struct max77818_event */
+	__MAX77818_ATTR_MAX,
+};
+#define MAX77818_ATTR_MAX (__MAX77818_ATTR_MAX - 1)
+
+enum max77818_event_source {
+	MAX77818_EVENT_FG,                      /* Fuelgauge alert, alerts holds Status */
+	MAX77818_EVENT_CHG,                     /* Charger source, alerts holds its CHG_INT_OK bit */
+};
+
+/* Fields not provided by the source are MAX77818_EVENT_NA */
+#define MAX77818_EVENT_NA       (-2147483647 - 1)
+
+struct max77818_event {
+	__u64 timestamp_ns;                     /* CLOCK_BOOTTIME */
+	__u32 id;                               /* PMIC instance */
+	__u16 source;                           /* enum max77818_event_source */
+	__u16 alerts;
+	__s32 old_state;                        /* CHG_DTLS before the event, -1 if unknown */
+	__s32 new_state;                        /* CHG_DTLS after the event */
+	__s32 soc;                              /* RepSOC [%] */
+	__s32 vcell_uv;
+	__s32 curr_ua;
+	__s32 temp;                             /* [0.1 C] */
+};
+
+/* Fuelgauge character device, /dev/max77818-fg[-N] */
+
+#define MAX77818_TELEM_MAGIC       0x544C384D  /* "M8LT" */
+#define MAX77818_TELEM_VERSION     1
+
+/*
+ * Telemetry ring buffer layout, mapped read-only from the fuelgauge
+ * character device. The header occupies the first page, records start at
+ * data_offset. Record n lives in slot n % nr_records, head is the number
+ * of records written so far and is published after the record is complete.
+ * A reader copies a record and then re-reads head to make sure the slot
+ * has not been overwritten meanwhile.
+ */
+struct max77818_telem_header {
+	__u32 magic;
+	__u16 version;
+	__u16 record_size;
+	__u32 nr_records;
+	__u32 data_offset;
+	__u32 rate_hz;
+	__u32 head;
+};
+
+/* Raw register values, timestamp is CLOCK_MONOTONIC */
+struct max77818_telem_record {
+	__u64 timestamp_ns;
+	__u16 vcell;        /* 78.125 uV/LSB */
+	__s16 curr;         /* 1.5625 uV/LSB over sense resistor */
+	__s16 temp;         /* 1/256 C/LSB */
+	__u16 rep_soc;      /* 1/256 %/LSB */
+};
+
+#define MAX77818_ATRATE_MAX        16
+
+/* AtRate what-if query, load_ua is positive for a discharge load */
+struct max77818_atrate_query {
+	__s32 load_ua;
+	__u32 tte_s;
+	__u32 av_cap_uah;
+	__u32 qresidual_uah;
+	__u32 av_soc;       /* 1/256 %/LSB */
+};
+
+struct max77818_atrate_batch {
+	__u32 count;
+	__u32 reserved;
+	struct max77818_atrate_query q[MAX77818_ATRATE_MAX];
+};
+
+/* Learned parameter registers, in the order of the learned_params image */
+#define MAX77818_LEARNED_COUNT     11
+
+enum max77818_temp_status {
+	MAX77818_TEMP_LOW,
+	MAX77818_TEMP_NORMAL,
+	MAX77818_TEMP_HIGH,
+};
+
+#define MAX77818_STATE_VERSION     1
+#define MAX77818_STATE_FRESH       (1 << 0)     /* Read the PMIC instead of the cache */
+#define MAX77818_STATE_FG_REGS     0x30         /* Fuelgauge 0x00..0x2F */
+#define MAX77818_STATE_CHG_REGS    18           /* Charger CHG_INT_OK (0xB2)..CHG_CNFG_12 */
+
+/*
+ * Fuelgauge and charger state in one call. version is set by the caller
+ * to the MAX77818_STATE_VERSION it was built against, 0 is rejected, and
+ * is returned as the version filled in. Without MAX77818_STATE_FRESH the
+ * measurements come from the energy integrator's last sample and the
+ * learned params as last read, fg_regs and chg_regs are then left zero.
+ * The top level block only holds IDs and clear-on-read interrupt flags
+ * and is not part of the snapshot.
+ */
+struct max77818_state {
+	__u32 version;
+	__u32 flags;
+	__u64 timestamp_ns;                     /* CLOCK_MONOTONIC of the measurements */
+	__s32 vcell_uv;
+	__s32 avg_vcell_uv;
+	__s32 curr_ua;
+	__s32 avg_curr_ua;
+	__s32 soc;                              /* [%] */
+	__s32 temp;                             /* [0.1 C] */
+	__s32 status;                           /* POWER_SUPPLY_STATUS_* */
+	__s32 temp_status;                      /* enum max77818_temp_status */
+	__u32 power_budget_uw;
+	__s32 chg_mode;                         /* Effective CHG_CNFG_00 MODE */
+	__u64 energy_charged_uj;
+	__u64 energy_discharged_uj;
+	__u16 learned[MAX77818_LEARNED_COUNT];
+	__u16 fg_regs[MAX77818_STATE_FG_REGS];
+	__u8 chg_regs[MAX77818_STATE_CHG_REGS];
+};
+
+#define MAX77818_IOC_MAGIC         'M'
+#define MAX77818_IOC_ATRATE        _IOWR(MAX77818_IOC_MAGIC, 0x01, struct max77818_atrate_batch)
+#define MAX77818_IOC_GET_STATE     _IOWR(MAX77818_IOC_MAGIC, 0x02, struct max77818_state)
+
+#endif
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Cost of polling the fuelgauge through sysfs: the usual open, getline,
+ * stoi per value against the library's kept-open descriptors.
+ *
+ *   bench_sysfs [--root DIR] [--iterations N] [--fake]
+ *
+ * --fake builds a throw-away tree with the same layout in /tmp so the
+ * userspace side can be measured without the hardware.
+ */
+
+#include <max77818/max77818.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char *const kFgProps[] = {
+	"capacity", "voltage_now", "voltage_avg", "voltage_ocv", "current_now",
+	"current_avg", "charge_now", "charge_full", "temp", "time_to_empty_now",
+	"time_to_full_now", "cycle_count", "power_now", "energy_now",
+};
+
+const char *const kFgDeviceAttrs[] = {
+	"ain0", "learned_rcomp0", "learned_temp_co", "learned_full_cap_rep",
+	"learned_cycles", "learned_full_cap_nom", "learned_qresidual00",
+	"learned_qresidual10", "learned_qresidual20", "learned_qresidual30",
+	"learned_cv_mixcap", "learned_cv_halftime",
+};
+
+void write_file(const std::string &path, const char *val)
+{
+	std::ofstream(path) << val << '\n';
+}
+
+std::string make_fake_tree()
+{
+	char tmpl[] = "/tmp/max77818-bench-XXXXXX";
+	std::string dir;
+
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	dir = std::string(tmpl) + "/max77818-fg";
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/device").c_str(), 0755);
+
+	write_file(dir + "/status", "Discharging");
+	for (const char *prop : kFgProps)
+		write_file(dir + "/" + prop, "-1234567");
+	for (const char *attr : kFgDeviceAttrs)
+		write_file(dir + "/device/" + attr, "17408");
+
+	return tmpl;
+}
+
+void remove_tree(const std::string &root)
+{
+	nftw(root.c_str(),
+	     [](const char *path, const struct stat *, int, struct FTW *) {
+		     return remove(path);
+	     },
+	     8, FTW_DEPTH | FTW_PHYS);
+}
+
+/* What most monitoring daemons do */
+int naive_read(const std::string &dir, max77818::FuelGaugeState &state)
+{
+	int *fields[] = {
+		&state.capacity, &state.voltage_now_uv, &state.voltage_avg_uv,
+		&state.voltage_ocv_uv, &state.current_now_ua, &state.current_avg_ua,
+		&state.charge_now_uah, &state.charge_full_uah, &state.temp,
+		&state.time_to_empty_s, &state.time_to_full_s, &state.cycle_count,
+		&state.power_now_uw, &state.energy_now_uwh,
+	};
+	std::string line;
+	std::size_t i;
+
+	{
+		std::ifstream f(dir + "/status");
+		if (!std::getline(f, line))
+			return -1;
+		state.status = max77818::parse_status(line);
+	}
+
+	for (i = 0; i < std::size(fields); i++) {
+		std::ifstream f(dir + "/" + kFgProps[i]);
+		if (!std::getline(f, line))
+			return -1;
+		*fields[i] = std::stoi(line);
+	}
+
+	return 0;
+}
+
+template <typename F>
+double measure(unsigned long iterations, F &&fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		if (fn()) {
+			fprintf(stderr, "read failed\n");
+			exit(1);
+		}
+	}
+
+	std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+	return d.count() / iterations;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	std::string root = "/sys/class/power_supply";
+	unsigned long iterations = 10000;
+	bool fake = false;
+	max77818::FuelGaugeState state;
+	max77818::FuelGauge fg;
+	double naive, lib;
+	int ret_val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--fake")) {
+			fake = true;
+		} else if (!strcmp(argv[i], "--root") && i + 1 < argc) {
+			root = argv[++i];
+		} else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+			iterations = strtoul(argv[++i], nullptr, 0);
+		} else {
+			fprintf(stderr, "usage: %s [--root DIR] [--iterations N] [--fake]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	if (!iterations)
+		iterations = 1;
+	if (fake)
+		root = make_fake_tree();
+
+	ret_val = fg.open(0, root);
+	if (ret_val) {
+		fprintf(stderr, "cannot open fuelgauge under %s: %s\n",
+			root.c_str(), strerror(-ret_val));
+		if (fake)
+			remove_tree(root);
+		return 1;
+	}
+
+	naive = measure(iterations, [&] { return naive_read(root + "/max77818-fg", state); });
+	lib = measure(iterations, [&] { return fg.read(state); });
+
+	printf("%-28s %10.0f ns/read\n", "ifstream+getline+stoi", naive);
+	printf("%-28s %10.0f ns/read\n", "max77818::FuelGauge::read", lib);
+	printf("%-28s %10.1fx\n", "speedup", naive / lib);
+
+	if (fake)
+		remove_tree(root);
+
+	return 0;
+}
@@ -0,0 +1,381 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Concurrent stress run against one PMIC. A reader pinned to every online
+ * CPU cycles through the fuelgauge and charger properties, the learned_*
+ * attributes and GET_STATE. Meanwhile writers trigger load_params and
+ * self_test in a loop, uevents are counted and, optionally, the charger
+ * and fuelgauge ISRs are fired from debugfs at the same time.
+ *
+ *   stress_concurrent [--instance N] [--seconds S] [--fresh] [--no-writers]
+ *                     [--fire "<src|sys|chg> <index>"]... [--fire-rate HZ]
+ *
+ * "src 0" is the fuelgauge alert, "chg <n>" the charger sources, so
+ * --fire "src 0" --fire "chg 3" storms both ISRs at once.
+ *
+ * Reports per-core throughput and p99 latency, the writer results, the
+ * uevents seen and every lockdep, KASAN or WARNING report the kernel
+ * logged during the run. Exits 1 when the kernel reported anything or no
+ * reader got going. Run as root on a kernel with PROVE_LOCKING and KASAN
+ * for the findings to mean something.
+ */
+
+#include <max77818/max77818.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/* Substrings of the kernel reports worth failing the run on */
+const char *const kKmsgFindings[] = {
+	"possible circular locking dependency",
+	"possible recursive locking detected",
+	"inconsistent lock state",
+	"suspicious RCU usage",
+	"BUG: sleeping function called from invalid context",
+	"BUG: KASAN:",
+	"BUG: KFENCE:",
+	"WARNING:",
+	"Oops",
+};
+
+struct Worker {
+	int cpu;
+	unsigned long ops = 0;
+	unsigned long errors = 0;
+	std::vector<std::uint32_t> latency_ns;
+};
+
+/* A sysfs or debugfs file written in a loop */
+struct Writer {
+	std::string path;
+	std::string val;
+	std::chrono::nanoseconds period;
+	unsigned long ok = 0;
+	unsigned long busy = 0;
+	unsigned long errors = 0;
+};
+
+struct Options {
+	int instance = 0;
+	unsigned int seconds = 10;
+	bool fresh = false;
+	bool writers = true;
+	std::vector<std::string> fire;
+	unsigned int fire_rate = 1000;
+};
+
+std::string node_dir(const char *base, int instance)
+{
+	std::string dir = std::string("/sys/class/power_supply/") + base;
+
+	if (instance)
+		dir += "-" + std::to_string(instance);
+
+	return dir;
+}
+
+void pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void run_reader(Worker &w, const Options &opt, const std::atomic<bool> &stop)
+{
+	max77818::FuelGaugeState fg_state;
+	max77818::ChargerState chg_state;
+	max77818::LearnedParams learned;
+	max77818::State state;
+	max77818::FuelGauge fg;
+	max77818::Charger chg;
+	max77818::Device dev;
+	bool have_fg, have_chg, have_dev;
+
+	pin_to_cpu(w.cpu);
+
+	/* Own descriptors per thread, the driver sees independent readers */
+	have_fg = !fg.open(opt.instance);
+	have_chg = !chg.open(opt.instance);
+	have_dev = !dev.open(opt.instance);
+	if (!have_fg && !have_chg && !have_dev)
+		return;
+
+	w.latency_ns.reserve(1 << 20);
+
+	for (unsigned long i = 0; !stop.load(std::memory_order_relaxed); i++) {
+		auto start = Clock::now();
+		int ret_val;
+
+		switch (i % 4) {
+		case 0:
+			if (!have_fg)
+				continue;
+			ret_val = fg.read(fg_state);
+			break;
+		case 1:
+			if (!have_fg)
+				continue;
+			ret_val = fg.read_learned(learned);
+			break;
+		case 2:
+			if (!have_chg)
+				continue;
+			ret_val = chg.read(chg_state);
+			break;
+		default:
+			if (!have_dev)
+				continue;
+			ret_val = dev.state(state, opt.fresh);
+			break;
+		}
+
+		std::chrono::nanoseconds d = Clock::now() - start;
+
+		if (ret_val)
+			w.errors++;
+		w.ops++;
+		w.latency_ns.push_back(std::min<std::int64_t>(d.count(), UINT32_MAX));
+	}
+}
+
+/* EBUSY is a self-test still running, not a failure */
+void run_writer(Writer &wr, const std::atomic<bool> &stop)
+{
+	auto next = Clock::now();
+	int fd;
+
+	fd = open(wr.path.c_str(), O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", wr.path.c_str(), strerror(errno));
+		return;
+	}
+
+	while (!stop.load(std::memory_order_relaxed)) {
+		if (pwrite(fd, wr.val.data(), wr.val.size(), 0) > 0)
+			wr.ok++;
+		else if (errno == EBUSY)
+			wr.busy++;
+		else
+			wr.errors++;
+		next += wr.period;
+		std::this_thread::sleep_until(next);
+	}
+
+	close(fd);
+}
+
+void run_events(unsigned long &charger, unsigned long &fuelgauge,
+		const std::atomic<bool> &stop)
+{
+	max77818::EventStream events;
+	max77818::Event ev;
+	struct pollfd pfd;
+
+	if (events.open())
+		return;
+
+	pfd.fd = events.fd();
+	pfd.events = POLLIN;
+
+	while (!stop.load(std::memory_order_relaxed)) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		while (events.next(ev) > 0) {
+			if (ev.source == max77818::Event::Source::Charger)
+				charger++;
+			else
+				fuelgauge++;
+		}
+	}
+}
+
+/* Positioned at the end so only reports logged during the run are seen */
+int open_kmsg()
+{
+	int fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK);
+
+	if (fd < 0)
+		fprintf(stderr, "cannot open /dev/kmsg: %s, kernel reports not checked\n",
+			strerror(errno));
+	else
+		lseek(fd, 0, SEEK_END);
+
+	return fd;
+}
+
+unsigned int scan_kmsg(int fd)
+{
+	unsigned int findings = 0;
+	char rec[8192];
+	ssize_t len;
+
+	if (fd < 0)
+		return 0;
+
+	for (;;) {
+		len = read(fd, rec, sizeof(rec) - 1);
+		if (len < 0 && errno == EPIPE)
+			continue;               /* Overwritten records, keep going */
+		if (len <= 0)
+			break;
+		rec[len] = 0;
+
+		/* "<prio>,<seq>,<ts>,<flags>;<message>\n" plus continuation lines */
+		const char *msg = strchr(rec, ';');
+		msg = msg ? msg + 1 : rec;
+
+		for (const char *pattern : kKmsgFindings) {
+			if (strstr(msg, pattern)) {
+				printf("kmsg: %.*s\n", (int)strcspn(msg, "\n"), msg);
+				findings++;
+				break;
+			}
+		}
+	}
+
+	return findings;
+}
+
+double percentile_us(std::vector<std::uint32_t> &v, double p)
+{
+	std::size_t n;
+
+	if (v.empty())
+		return 0;
+
+	n = std::min(v.size() - 1, (std::size_t)(p * v.size()));
+	std::nth_element(v.begin(), v.begin() + n, v.end());
+
+	return v[n] / 1000.0;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	unsigned long uevents_chg = 0, uevents_fg = 0;
+	unsigned long total_ops = 0, total_errors = 0;
+	std::vector<std::uint32_t> all_latency;
+	std::vector<std::thread> threads;
+	std::vector<Worker> workers;
+	std::vector<Writer> writers;
+	std::atomic<bool> stop{false};
+	std::string fg_dev, debugfs;
+	unsigned int findings;
+	Options opt;
+	long ncpus;
+	int kmsg;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--instance") && i + 1 < argc) {
+			opt.instance = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+			opt.seconds = strtoul(argv[++i], nullptr, 0);
+		} else if (!strcmp(argv[i], "--fresh")) {
+			opt.fresh = true;
+		} else if (!strcmp(argv[i], "--no-writers")) {
+			opt.writers = false;
+		} else if (!strcmp(argv[i], "--fire") && i + 1 < argc) {
+			opt.fire.push_back(argv[++i]);
+		} else if (!strcmp(argv[i], "--fire-rate") && i + 1 < argc) {
+			opt.fire_rate = strtoul(argv[++i], nullptr, 0);
+		} else {
+			fprintf(stderr,
+				"usage: %s [--instance N] [--seconds S] [--fresh] [--no-writers]\n"
+				"          [--fire \"<src|sys|chg> <index>\"]... [--fire-rate HZ]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	if (!opt.seconds)
+		opt.seconds = 1;
+	if (!opt.fire_rate)
+		opt.fire_rate = 1;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	fg_dev = node_dir("max77818-fg", opt.instance) + "/device/";
+	debugfs = "/sys/kernel/debug/max77818-" + std::to_string(opt.instance) + "/fire_irq";
+
+	if (opt.writers) {
+		writers.push_back({ fg_dev + "load_params", "1", std::chrono::milliseconds(10) });
+		writers.push_back({ fg_dev + "self_test", "1", std::chrono::milliseconds(100) });
+	}
+	for (const std::string &spec : opt.fire)
+		writers.push_back({ debugfs, spec,
+				    std::chrono::nanoseconds(1000000000) / opt.fire_rate });
+
+	kmsg = open_kmsg();
+
+	/* Sized up front, the threads keep references into both vectors */
+	workers.resize(ncpus);
+	for (i = 0; i < ncpus; i++) {
+		workers[i].cpu = i;
+		threads.emplace_back(run_reader, std::ref(workers[i]), std::cref(opt),
+				     std::cref(stop));
+	}
+	for (Writer &wr : writers)
+		threads.emplace_back(run_writer, std::ref(wr), std::cref(stop));
+	threads.emplace_back(run_events, std::ref(uevents_chg), std::ref(uevents_fg),
+			     std::cref(stop));
+
+	std::this_thread::sleep_for(std::chrono::seconds(opt.seconds));
+	stop = true;
+	for (auto &t : threads)
+		t.join();
+
+	printf("%-6s %12s %12s %10s %10s %8s\n", "cpu", "ops", "ops/s", "p50 us",
+	       "p99 us", "errors");
+	for (auto &w : workers) {
+		all_latency.insert(all_latency.end(), w.latency_ns.begin(), w.latency_ns.end());
+		total_ops += w.ops;
+		total_errors += w.errors;
+
+		printf("%-6d %12lu %12.0f %10.1f %10.1f %8lu\n", w.cpu, w.ops,
+		       (double)w.ops / opt.seconds, percentile_us(w.latency_ns, 0.50),
+		       percentile_us(w.latency_ns, 0.99), w.errors);
+	}
+	printf("%-6s %12lu %12.0f %10.1f %10.1f %8lu\n", "all", total_ops,
+	       (double)total_ops / opt.seconds, percentile_us(all_latency, 0.50),
+	       percentile_us(all_latency, 0.99), total_errors);
+
+	for (auto &wr : writers)
+		printf("write \"%s\" > %s: %lu ok, %lu busy, %lu errors\n", wr.val.c_str(),
+		       wr.path.c_str(), wr.ok, wr.busy, wr.errors);
+	printf("uevents: charger %lu fuelgauge %lu\n", uevents_chg, uevents_fg);
+
+	if (!total_ops)
+		fprintf(stderr, "no reader could open max77818 instance %d\n", opt.instance);
+
+	findings = scan_kmsg(kmsg);
+	printf("kernel reports: %u\n", findings);
+	if (kmsg >= 0)
+		close(kmsg);
+
+	return findings || !total_ops ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef MAX77818_HPP_
+#define MAX77818_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <linux/max77818.h>
+
+/*
+ * Userspace access to the MAX77818 charger and fuelgauge drivers.
+ *
+ * Attribute files are opened once and re-read with pread(), values are
+ * parsed in place without allocating. All calls return 0 or a negative
+ * errno, like the driver they talk to. Opening allocates, reading does not.
+ */
+namespace max77818 {
+
+/* POWER_SUPPLY_STATUS_* */
+enum class Status : int {
+	Unknown,
+	Charging,
+	Discharging,
+	NotCharging,
+	Full,
+};
+
+/* POWER_SUPPLY_CHARGE_TYPE_* */
+enum class ChargeType : int {
+	Unknown,
+	None,
+	Trickle,
+	Fast,
+};
+
+/* POWER_SUPPLY_HEALTH_* */
+enum class Health : int {
+	Unknown,
+	Good,
+	Overheat,
+	Dead,
+	OverVoltage,
+	UnspecFailure,
+	Cold,
+	WatchdogTimerExpire,
+	SafetyTimerExpire,
+};
+
+struct ChargerState {
+	Status status;
+	ChargeType charge_type;
+	Health health;
+	bool present;
+	bool online;
+	int mode;                               /* CHG_CNFG_00 MODE */
+	int byp_dtls;
+};
+
+struct FuelGaugeState {
+	Status status;
+	int capacity;                           /* [%] */
+	int voltage_now_uv;
+	int voltage_avg_uv;
+	int voltage_ocv_uv;
+	int current_now_ua;
+	int current_avg_ua;
+	int charge_now_uah;
+	int charge_full_uah;
+	int temp;                               /* [0.1 C] */
+	int time_to_empty_s;
+	int time_to_full_s;
+	int cycle_count;
+	int power_now_uw;
+	int energy_now_uwh;
+};
+
+/* Raw register values of the learned_* attributes */
+struct LearnedParams {
+	unsigned int rcomp0;
+	unsigned int temp_co;
+	unsigned int full_cap_rep;
+	unsigned int cycles;
+	unsigned int full_cap_nom;
+	unsigned int qresidual00;
+	unsigned int qresidual10;
+	unsigned int qresidual20;
+	unsigned int qresidual30;
+	unsigned int cv_mixcap;
+	unsigned int cv_halftime;
+};
+
+/* One sysfs attribute kept open for repeated reads */
+class Attribute {
+public:
+	Attribute() = default;
+	~Attribute();
+	Attribute(Attribute &&other) noexcept;
+	Attribute &operator=(Attribute &&other) noexcept;
+	Attribute(const Attribute &) = delete;
+	Attribute &operator=(const Attribute &) = delete;
+
+	int open(const std::string &path);
+	void close();
+	bool is_open() const { return fd_ >= 0; }
+
+	/* Value without the trailing newline, backed by buf */
+	int read(char *buf, std::size_t len, std::string_view &val) const;
+	int read_int(int &val) const;
+	int read_uint(unsigned int &val) const;
+
+private:
+	int fd_ = -1;
+};
+
+/* /sys/class/power_supply/max77818-chg[-N] and its device attributes */
+class Charger {
+public:
+	int open(int instance = 0, const std::string &root = "/sys/class/power_supply");
+	int read(ChargerState &state) const;
+
+private:
+	Attribute status_, charge_type_, health_, present_, online_;
+	Attribute mode_, byp_dtls_;
+};
+
+/* /sys/class/power_supply/max77818-fg[-N] and its device attributes */
+class FuelGauge {
+public:
+	int open(int instance = 0, const std::string &root = "/sys/class/power_supply");
+	int read(FuelGaugeState &state) const;
+	int read_learned(LearnedParams &params) const;
+	int read_ain0(int &val) const;
+
+private:
+	Attribute status_, capacity_, voltage_now_, voltage_avg_, voltage_ocv_;
+	Attribute current_now_, current_avg_, charge_now_, charge_full_, temp_;
+	Attribute time_to_empty_, time_to_full_, cycle_count_, power_now_, energy_now_;
+	Attribute learned_[MAX77818_LEARNED_COUNT];
+	Attribute ain0_;
+};
+
+/* ABI of the fuelgauge character device, from the uapi header */
+using State = ::max77818_state;
+using TelemetryHeader = ::max77818_telem_header;
+using TelemetryRecord = ::max77818_telem_record;
+
+/* /dev/max77818-fg[-N]: GET_STATE and the mmapped telemetry ring */
+class Device {
+public:
+	Device() = default;
+	~Device();
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	int open(int instance = 0, const std::string &dev = "/dev");
+	void close();
+
+	/* Whole state in one ioctl, fresh bypasses the driver's cache */
+	int state(State &state, bool fresh = false) const;
+
+	/*
+	 * Copy records from *cursor on straight out of the shared ring, no
+	 * read() involved. Returns the number copied and advances cursor.
+	 * Records the writer overran are skipped, *lost counts them.
+	 */
+	int telemetry(TelemetryRecord *out, std::size_t max, std::uint32_t &cursor,
+		      std::uint32_t *lost = nullptr) const;
+
+private:
+	int fd_ = -1;
+	void *ring_ = nullptr;
+	std::size_t ring_len_ = 0;
+};
+
+/* A change reported by a power_supply uevent of one of the two nodes */
+struct Event {
+	enum class Source { Charger, FuelGauge } source;
+	int instance;
+	ChargerState charger;                   /* Valid for Source::Charger */
+	FuelGaugeState fuelgauge;               /* Valid for Source::FuelGauge */
+};
+
+/*
+ * power_supply uevents of the MAX77818 nodes, decoded from the uevent
+ * netlink socket. The uevent carries every property, so a consumer gets
+ * the whole state without touching sysfs.
+ *
+ * The socket is non-blocking: wait for fd() to become readable in any
+ * event loop (epoll, io_uring, an asio/coroutine awaiter on the fd) and
+ * drain with next() until it returns 0.
+ */
+class EventStream {
+public:
+	EventStream() = default;
+	~EventStream();
+	EventStream(const EventStream &) = delete;
+	EventStream &operator=(const EventStream &) = delete;
+
+	int open();
+	int fd() const { return fd_; }
+
+	/* 1 with ev filled, 0 when nothing is pending, or a negative errno */
+	int next(Event &ev);
+
+private:
+	int fd_ = -1;
+	char buf_[8192];
+};
+
+/* Parsers shared with the uevent decoder, exposed for the benchmark */
+int parse_int(std::string_view s, int &val);
+Status parse_status(std::string_view s);
+ChargeType parse_charge_type(std::string_view s);
+Health parse_health(std::string_view s);
+
+} /* namespace max77818 */
+
+#endif
@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <max77818/max77818.hpp>
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+
+namespace max77818 {
+
+namespace {
+
+constexpr std::string_view kChargerName = "max77818-chg";
+constexpr std::string_view kFuelGaugeName = "max77818-fg";
+
+/* Same order as the learned_params image and State::learned */
+constexpr const char *kLearnedAttrs[] = {
+	"learned_rcomp0", "learned_temp_co", "learned_full_cap_rep",
+	"learned_cycles", "learned_full_cap_nom", "learned_qresidual00",
+	"learned_qresidual10", "learned_qresidual20", "learned_qresidual30",
+	"learned_cv_mixcap", "learned_cv_halftime",
+};
+
+std::string node_name(std::string_view base, int instance)
+{
+	std::string name(base);
+
+	/* The first PMIC keeps the unsuffixed names */
+	if (instance)
+		name += "-" + std::to_string(instance);
+
+	return name;
+}
+
+/* "max77818-fg" -> 0, "max77818-fg-2" -> 2, anything else -> -1 */
+int node_instance(std::string_view name, std::string_view base)
+{
+	int instance;
+
+	if (name.substr(0, base.size()) != base)
+		return -1;
+
+	name.remove_prefix(base.size());
+	if (name.empty())
+		return 0;
+	if (name[0] != '-')
+		return -1;
+
+	name.remove_prefix(1);
+	if (parse_int(name, instance) || instance < 0)
+		return -1;
+
+	return instance;
+}
+
+template <typename T>
+T lookup(std::string_view s, const std::string_view *names, std::size_t n)
+{
+	for (std::size_t i = 0; i < n; i++) {
+		if (s == names[i])
+			return static_cast<T>(i);
+	}
+
+	return static_cast<T>(0);
+}
+
+int read_status(const Attribute &attr, Status &val)
+{
+	char buf[32];
+	std::string_view s;
+	int ret_val;
+
+	ret_val = attr.read(buf, sizeof(buf), s);
+	if (ret_val)
+		return ret_val;
+
+	val = parse_status(s);
+	return 0;
+}
+
+int read_bool(const Attribute &attr, bool &val)
+{
+	int data;
+	int ret_val;
+
+	ret_val = attr.read_int(data);
+	if (ret_val)
+		return ret_val;
+
+	val = data != 0;
+	return 0;
+}
+
+} /* namespace */
+
+int parse_int(std::string_view s, int &val)
+{
+	const char *first = s.data();
+	const char *last = s.data() + s.size();
+
+	while (last > first && (last[-1] == '\n' || last[-1] == ' '))
+		last--;
+
+	auto res = std::from_chars(first, last, val);
+	if (res.ec != std::errc() || res.ptr != last)
+		return -EINVAL;
+
+	return 0;
+}
+
+Status parse_status(std::string_view s)
+{
+	static constexpr std::string_view names[] = {
+		"Unknown", "Charging", "Discharging", "Not charging", "Full",
+	};
+
+	return lookup<Status>(s, names, std::size(names));
+}
+
+ChargeType parse_charge_type(std::string_view s)
+{
+	static constexpr std::string_view names[] = {
+		"Unknown", "N/A", "Trickle", "Fast",
+	};
+
+	return lookup<ChargeType>(s, names, std::size(names));
+}
+
+Health parse_health(std::string_view s)
+{
+	static constexpr std::string_view names[] = {
+		"Unknown", "Good", "Overheat", "Dead", "Over voltage",
+		"Unspecified failure", "Cold", "Watchdog timer expire",
+		"Safety timer expire",
+	};
+
+	return lookup<Health>(s, names, std::size(names));
+}
+
+Attribute::~Attribute()
+{
+	close();
+}
+
+Attribute::Attribute(Attribute &&other) noexcept : fd_(other.fd_)
+{
+	other.fd_ = -1;
+}
+
+Attribute &Attribute::operator=(Attribute &&other) noexcept
+{
+	if (this != &other) {
+		close();
+		fd_ = other.fd_;
+		other.fd_ = -1;
+	}
+
+	return *this;
+}
+
+int Attribute::open(const std::string &path)
+{
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	close();
+	fd_ = fd;
+
+	return 0;
+}
+
+void Attribute::close()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+int Attribute::read(char *buf, std::size_t len, std::string_view &val) const
+{
+	ssize_t n;
+
+	/* sysfs regenerates the value on every read from offset 0 */
+	n = ::pread(fd_, buf, len, 0);
+	if (n < 0)
+		return -errno;
+
+	while (n > 0 && buf[n - 1] == '\n')
+		n--;
+
+	val = std::string_view(buf, n);
+	return 0;
+}
+
+int Attribute::read_int(int &val) const
+{
+	char buf[32];
+	std::string_view s;
+	int ret_val;
+
+	ret_val = read(buf, sizeof(buf), s);
+	if (ret_val)
+		return ret_val;
+
+	return parse_int(s, val);
+}
+
+int Attribute::read_uint(unsigned int &val) const
+{
+	int data;
+	int ret_val;
+
+	ret_val = read_int(data);
+	if (ret_val)
+		return ret_val;
+
+	val = static_cast<unsigned int>(data);
+	return 0;
+}
+
+int Charger::open(int instance, const std::string &root)
+{
+	const std::string dir = root + "/" + node_name(kChargerName, instance) + "/";
+	int ret_val;
+
+	if ((ret_val = status_.open(dir + "status")) ||
+	    (ret_val = charge_type_.open(dir + "charge_type")) ||
+	    (ret_val = health_.open(dir + "health")) ||
+	    (ret_val = present_.open(dir + "present")) ||
+	    (ret_val = online_.open(dir + "online")) ||
+	    (ret_val = mode_.open(dir + "device/max77818_chg_mode")) ||
+	    (ret_val = byp_dtls_.open(dir + "device/max77818_chg_byp_dtls")))
+		return ret_val;
+
+	return 0;
+}
+
+int Charger::read(ChargerState &state) const
+{
+	char buf[32];
+	std::string_view s;
+	int ret_val;
+
+	if ((ret_val = read_status(status_, state.status)))
+		return ret_val;
+
+	if ((ret_val = charge_type_.read(buf, sizeof(buf), s)))
+		return ret_val;
+	state.charge_type = parse_charge_type(s);
+
+	if ((ret_val = health_.read(buf, sizeof(buf), s)))
+		return ret_val;
+	state.health = parse_health(s);
+
+	if ((ret_val = read_bool(present_, state.present)) ||
+	    (ret_val = read_bool(online_, state.online)) ||
+	    (ret_val = mode_.read_int(state.mode)) ||
+	    (ret_val = byp_dtls_.read_int(state.byp_dtls)))
+		return ret_val;
+
+	return 0;
+}
+
+int FuelGauge::open(int instance, const std::string &root)
+{
+	const std::string dir = root + "/" + node_name(kFuelGaugeName, instance) + "/";
+	int ret_val;
+	std::size_t i;
+
+	if ((ret_val = status_.open(dir + "status")) ||
+	    (ret_val = capacity_.open(dir + "capacity")) ||
+	    (ret_val = voltage_now_.open(dir + "voltage_now")) ||
+	    (ret_val = voltage_avg_.open(dir + "voltage_avg")) ||
+	    (ret_val = voltage_ocv_.open(dir + "voltage_ocv")) ||
+	    (ret_val = current_now_.open(dir + "current_now")) ||
+	    (ret_val = current_avg_.open(dir + "current_avg")) ||
+	    (ret_val = charge_now_.open(dir + "charge_now")) ||
+	    (ret_val = charge_full_.open(dir + "charge_full")) ||
+	    (ret_val = temp_.open(dir + "temp")) ||
+	    (ret_val = time_to_empty_.open(dir + "time_to_empty_now")) ||
+	    (ret_val = time_to_full_.open(dir + "time_to_full_now")) ||
+	    (ret_val = cycle_count_.open(dir + "cycle_count")) ||
+	    (ret_val = power_now_.open(dir + "power_now")) ||
+	    (ret_val = energy_now_.open(dir + "energy_now")) ||
+	    (ret_val = ain0_.open(dir + "device/ain0")))
+		return ret_val;
+
+	for (i = 0; i < std::size(kLearnedAttrs); i++) {
+		ret_val = learned_[i].open(dir + "device/" + kLearnedAttrs[i]);
+		if (ret_val)
+			return ret_val;
+	}
+
+	return 0;
+}
+
+int FuelGauge::read(FuelGaugeState &state) const
+{
+	int ret_val;
+
+	if ((ret_val = read_status(status_, state.status)) ||
+	    (ret_val = capacity_.read_int(state.capacity)) ||
+	    (ret_val = voltage_now_.read_int(state.voltage_now_uv)) ||
+	    (ret_val = voltage_avg_.read_int(state.voltage_avg_uv)) ||
+	    (ret_val = voltage_ocv_.read_int(state.voltage_ocv_uv)) ||
+	    (ret_val = current_now_.read_int(state.current_now_ua)) ||
+	    (ret_val = current_avg_.read_int(state.current_avg_ua)) ||
+	    (ret_val = charge_now_.read_int(state.charge_now_uah)) ||
+	    (ret_val = charge_full_.read_int(state.charge_full_uah)) ||
+	    (ret_val = temp_.read_int(state.temp)) ||
+	    (ret_val = time_to_empty_.read_int(state.time_to_empty_s)) ||
+	    (ret_val = time_to_full_.read_int(state.time_to_full_s)) ||
+	    (ret_val = cycle_count_.read_int(state.cycle_count)) ||
+	    (ret_val = power_now_.read_int(state.power_now_uw)) ||
+	    (ret_val = energy_now_.read_int(state.energy_now_uwh)))
+		return ret_val;
+
+	return 0;
+}
+
+int FuelGauge::read_learned(LearnedParams &params) const
+{
+	unsigned int *fields[] = {
+		&params.rcomp0, &params.temp_co, &params.full_cap_rep,
+		&params.cycles, &params.full_cap_nom, &params.qresidual00,
+		&params.qresidual10, &params.qresidual20, &params.qresidual30,
+		&params.cv_mixcap, &params.cv_halftime,
+	};
+	int ret_val;
+	std::size_t i;
+
+	static_assert(std::size(fields) == std::size(kLearnedAttrs));
+
+	for (i = 0; i < std::size(fields); i++) {
+		ret_val = learned_[i].read_uint(*fields[i]);
+		if (ret_val)
+			return ret_val;
+	}
+
+	return 0;
+}
+
+int FuelGauge::read_ain0(int &val) const
+{
+	return ain0_.read_int(val);
+}
+
+Device::~Device()
+{
+	close();
+}
+
+int Device::open(int instance, const std::string &dev)
+{
+	const std::string path = dev + "/" + node_name(kFuelGaugeName, instance);
+	const TelemetryHeader *hdr;
+	long page = sysconf(_SC_PAGESIZE);
+	void *map;
+	int ret_val;
+
+	close();
+
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+		return -errno;
+
+	/* Map the header page first to learn the size of the ring */
+	map = mmap(nullptr, page, PROT_READ, MAP_SHARED, fd_, 0);
+	if (map == MAP_FAILED) {
+		ret_val = -errno;
+		close();
+		return ret_val;
+	}
+
+	hdr = static_cast<const TelemetryHeader *>(map);
+	if (hdr->magic != MAX77818_TELEM_MAGIC || hdr->record_size != sizeof(TelemetryRecord)) {
+		munmap(map, page);
+		close();
+		return -EPROTO;
+	}
+
+	ring_len_ = hdr->data_offset +
+		    static_cast<std::size_t>(hdr->nr_records) * hdr->record_size;
+	munmap(map, page);
+
+	ring_ = mmap(nullptr, ring_len_, PROT_READ, MAP_SHARED, fd_, 0);
+	if (ring_ == MAP_FAILED) {
+		ret_val = -errno;
+		ring_ = nullptr;
+		close();
+		return ret_val;
+	}
+
+	return 0;
+}
+
+void Device::close()
+{
+	if (ring_)
+		munmap(ring_, ring_len_);
+	ring_ = nullptr;
+	ring_len_ = 0;
+
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+int Device::state(State &state, bool fresh) const
+{
+	std::memset(&state, 0, sizeof(state));
+	state.version = MAX77818_STATE_VERSION;
+	state.flags = fresh ? MAX77818_STATE_FRESH : 0;
+
+	if (ioctl(fd_, MAX77818_IOC_GET_STATE, &state) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int Device::telemetry(TelemetryRecord *out, std::size_t max, std::uint32_t &cursor,
+		      std::uint32_t *lost) const
+{
+	const auto *hdr = static_cast<const TelemetryHeader *>(ring_);
+	const TelemetryRecord *base;
+	std::uint32_t head, skipped = 0;
+	std::size_t n = 0;
+
+	if (!ring_)
+		return -EBADF;
+
+	base = reinterpret_cast<const TelemetryRecord *>(
+		static_cast<const char *>(ring_) + hdr->data_offset);
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	/* Everything older than one ring behind head is gone */
+	if (head - cursor > hdr->nr_records) {
+		skipped = head - cursor - hdr->nr_records;
+		cursor = head - hdr->nr_records;
+	}
+
+	while (cursor != head && n < max) {
+		out[n] = base[cursor % hdr->nr_records];
+
+		/* The writer may have lapped the slot while it was copied */
+		if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) - cursor > hdr->nr_records) {
+			skipped++;
+			cursor++;
+			continue;
+		}
+
+		n++;
+		cursor++;
+	}
+
+	if (lost)
+		*lost = skipped;
+
+	return static_cast<int>(n);
+}
+
+EventStream::~EventStream()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+int EventStream::open()
+{
+	struct sockaddr_nl addr = {};
+
+	fd_ = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		     NETLINK_KOBJECT_UEVENT);
+	if (fd_ < 0)
+		return -errno;
+
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;                     /* Kernel uevents */
+
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+		int ret_val = -errno;
+
+		::close(fd_);
+		fd_ = -1;
+		return ret_val;
+	}
+
+	return 0;
+}
+
+/*
+ * A uevent is "action@devpath" followed by NUL separated KEY=value pairs.
+ * Only power_supply change events of our nodes are decoded, the rest are
+ * consumed and skipped.
+ */
+int EventStream::next(Event &ev)
+{
+	constexpr std::string_view prefix = "POWER_SUPPLY_";
+	ssize_t len;
+
+	for (;;) {
+		len = recv(fd_, buf_, sizeof(buf_), 0);
+		if (len < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+
+		std::string_view msg(buf_, len);
+		std::string_view name;
+		bool power_supply = false;
+
+		ev = Event{};
+
+		/* First pass finds the node, the second decodes its fields */
+		for (int pass = 0; pass < 2; pass++) {
+			std::size_t pos = 0;
+
+			while (pos < msg.size()) {
+				std::size_t end = msg.find('\0', pos);
+				if (end == std::string_view::npos)
+					end = msg.size();
+
+				std::string_view field = msg.substr(pos, end - pos);
+				pos = end + 1;
+
+				if (pass == 0) {
+					if (field == "SUBSYSTEM=power_supply")
+						power_supply = true;
+					else if (field.substr(0, prefix.size() + 5) == "POWER_SUPPLY_NAME=")
+						name = field.substr(prefix.size() + 5);
+					continue;
+				}
+
+				if (field.substr(0, prefix.size()) != prefix)
+					continue;
+				field.remove_prefix(prefix.size());
+
+				std::size_t eq = field.find('=');
+				if (eq == std::string_view::npos)
+					continue;
+
+				std::string_view key = field.substr(0, eq);
+				std::string_view val = field.substr(eq + 1);
+
+				if (ev.source == Event::Source::Charger) {
+					ChargerState &c = ev.charger;
+					if (key == "STATUS")
+						c.status = parse_status(val);
+					else if (key == "CHARGE_TYPE")
+						c.charge_type = parse_charge_type(val);
+					else if (key == "HEALTH")
+						c.health = parse_health(val);
+					else if (key == "PRESENT") {
+						int v = 0;
+						parse_int(val, v);
+						c.present = v;
+					} else if (key == "ONLINE") {
+						int v = 0;
+						parse_int(val, v);
+						c.online = v;
+					}
+					continue;
+				}
+
+				FuelGaugeState &f = ev.fuelgauge;
+				const struct {
+					std::string_view key;
+					int *val;
+				} ints[] = {
+					{ "CAPACITY", &f.capacity },
+					{ "VOLTAGE_NOW", &f.voltage_now_uv },
+					{ "VOLTAGE_AVG", &f.voltage_avg_uv },
+					{ "VOLTAGE_OCV", &f.voltage_ocv_uv },
+					{ "CURRENT_NOW", &f.current_now_ua },
+					{ "CURRENT_AVG", &f.current_avg_ua },
+					{ "CHARGE_NOW", &f.charge_now_uah },
+					{ "CHARGE_FULL", &f.charge_full_uah },
+					{ "TEMP", &f.temp },
+					{ "TIME_TO_EMPTY_NOW", &f.time_to_empty_s },
+					{ "TIME_TO_FULL_NOW", &f.time_to_full_s },
+					{ "CYCLE_COUNT", &f.cycle_count },
+					{ "POWER_NOW", &f.power_now_uw },
+					{ "ENERGY_NOW", &f.energy_now_uwh },
+				};
+
+				if (key == "STATUS") {
+					f.status = parse_status(val);
+					continue;
+				}
+				for (const auto &i : ints) {
+					if (key == i.key) {
+						parse_int(val, *i.val);
+						break;
+					}
+				}
+			}
+
+			if (pass == 0) {
+				if (!power_supply)
+					break;
+				if ((ev.instance = node_instance(name, kChargerName)) >= 0)
+					ev.source = Event::Source::Charger;
+				else if ((ev.instance = node_instance(name, kFuelGaugeName)) >= 0)
+					ev.source = Event::Source::FuelGauge;
+				else
+					break;
+			} else {
+				return 1;
+			}
+		}
+	}
+}
+
+} /* namespace max77818 */